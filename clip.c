@@ -0,0 +1,390 @@
+/*
+ * clip.c - Clipping to a boundary polygon
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * The boundary is a set of segments, and a point is inside if a ray from it
+ * crosses them an odd number of times. This works for holes and for several
+ * outer rings alike, without having to know which is which.
+ *
+ * A raster over the boundary tells whether each cell is entirely inside,
+ * entirely outside, or on the border, so most points only need a lookup. For
+ * points in border cells, the ray to the right only has to go as far as the
+ * next cell that is not on the border, since that cell already knows how
+ * many crossings lie beyond it.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "util.h"
+#include "clip.h"
+
+
+#define	GRID		1024	/* cells along the longer side */
+#define	MAX_LINE	200
+
+enum cell {
+	cell_out	= 0,
+	cell_in		= 1,
+	cell_border	= 2,
+};
+
+
+bool clipping = 0;
+
+static struct seg {
+	double ax, ay;		/* lon, lat */
+	double bx, by;
+} *segs;
+static unsigned n_segs, segs_size;
+
+static double org_x, org_y;	/* lower left corner of the raster */
+static double scale;		/* cells per degree */
+static unsigned cols, rows;
+
+static uint8_t *cells;		/* enum cell */
+static uint32_t *cell_first;	/* segments touching each cell, as CSR */
+static uint32_t *cell_segs;
+
+
+/* ----- Reading ----------------------------------------------------------- */
+
+
+static void add_seg(double ax, double ay, double bx, double by)
+{
+	if (n_segs == segs_size) {
+		segs_size = segs_size ? 2*segs_size : 1024;
+		segs = realloc(segs, sizeof(struct seg)*segs_size);
+		if (!segs) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	segs[n_segs].ax = ax;
+	segs[n_segs].ay = ay;
+	segs[n_segs].bx = bx;
+	segs[n_segs].by = by;
+	n_segs++;
+}
+
+
+static bool get_line(FILE *file, char *buf, const char *name,
+    unsigned *lineno)
+{
+	char *end;
+
+	if (!fgets(buf, MAX_LINE, file))
+		return 0;
+	(*lineno)++;
+	end = strchr(buf, '\n');
+	if (!end && !feof(file)) {
+		fprintf(stderr, "%s:%u: line too long\n", name, *lineno);
+		exit(1);
+	}
+	if (end)
+		*end = 0;
+	return 1;
+}
+
+
+static bool is_end(const char *s)
+{
+	s += strspn(s, " \t");
+	return !strncmp(s, "END", 3) && !s[3 + strspn(s+3, " \t\r")];
+}
+
+
+static void read_rings(FILE *file, const char *name)
+{
+	char buf[MAX_LINE];
+	unsigned lineno = 0;
+	double x, y, fx = 0, fy = 0, px = 0, py = 0;
+	bool first;
+
+	if (!get_line(file, buf, name, &lineno))
+		goto eof;
+	while (1) {
+		if (!get_line(file, buf, name, &lineno))
+			goto eof;
+		if (is_end(buf))
+			break;
+		first = 1;
+		while (1) {
+			if (!get_line(file, buf, name, &lineno))
+				goto eof;
+			if (is_end(buf))
+				break;
+			if (sscanf(buf, "%lf %lf", &x, &y) != 2) {
+				fprintf(stderr,
+				    "%s:%u: expected \"lon lat\"\n",
+				    name, lineno);
+				exit(1);
+			}
+			if (first) {
+				fx = x;
+				fy = y;
+				first = 0;
+			} else {
+				add_seg(px, py, x, y);
+			}
+			px = x;
+			py = y;
+		}
+		if (!first && (px != fx || py != fy))
+			add_seg(px, py, fx, fy);
+	}
+	return;
+
+eof:
+	fprintf(stderr, "%s: unexpected end of file\n", name);
+	exit(1);
+}
+
+
+/* ----- Raster ------------------------------------------------------------ */
+
+
+static unsigned col_of(double x)
+{
+	int c = floor((x-org_x)*scale);
+
+	return c < 0 ? 0 : c >= (int) cols ? cols-1 : c;
+}
+
+
+static unsigned row_of(double y)
+{
+	int r = floor((y-org_y)*scale);
+
+	return r < 0 ? 0 : r >= (int) rows ? rows-1 : r;
+}
+
+
+/*
+ * Where segment "s" crosses the horizontal line at "y", if it does. We clamp
+ * the result to the segment, so that rounding can't move it into a cell that
+ * doesn't list the segment.
+ */
+
+static bool crossing(const struct seg *s, double y, double *x)
+{
+	double lo, hi;
+
+	if ((s->ay > y) == (s->by > y))
+		return 0;
+	*x = s->ax+(y-s->ay)*(s->bx-s->ax)/(s->by-s->ay);
+	lo = s->ax < s->bx ? s->ax : s->bx;
+	hi = s->ax < s->bx ? s->bx : s->ax;
+	if (*x < lo)
+		*x = lo;
+	if (*x > hi)
+		*x = hi;
+	return 1;
+}
+
+
+static void bounds(double *end_x, double *end_y)
+{
+	const struct seg *s;
+
+	org_x = *end_x = segs->ax;
+	org_y = *end_y = segs->ay;
+	for (s = segs; s != segs+n_segs; s++) {
+		org_x = fmin(org_x, fmin(s->ax, s->bx));
+		org_y = fmin(org_y, fmin(s->ay, s->by));
+		*end_x = fmax(*end_x, fmax(s->ax, s->bx));
+		*end_y = fmax(*end_y, fmax(s->ay, s->by));
+	}
+}
+
+
+/*
+ * The segment only goes through the cells of a row between where it enters
+ * and where it leaves the row. We widen the rows and columns by a small
+ * fraction of a cell, so that rounding can't lose a cell that cell_crossings
+ * or classify would look at.
+ */
+
+static void seg_rows(const struct seg *s, unsigned *r0, unsigned *r1)
+{
+	double eps = 1e-6/scale;
+
+	*r0 = row_of(fmin(s->ay, s->by)-eps);
+	*r1 = row_of(fmax(s->ay, s->by)+eps);
+}
+
+
+static void seg_cols(const struct seg *s, unsigned r, unsigned *c0,
+    unsigned *c1)
+{
+	double eps = 1e-6/scale;
+	double lo = fmin(s->ay, s->by), hi = fmax(s->ay, s->by);
+	double ya, yb, xa, xb;
+
+	ya = fmin(fmax(org_y+r/scale, lo), hi);
+	yb = fmax(fmin(org_y+(r+1)/scale, hi), lo);
+	if (s->ay == s->by) {
+		xa = s->ax;
+		xb = s->bx;
+	} else {
+		xa = s->ax+(ya-s->ay)*(s->bx-s->ax)/(s->by-s->ay);
+		xb = s->ax+(yb-s->ay)*(s->bx-s->ax)/(s->by-s->ay);
+	}
+	*c0 = col_of(fmin(xa, xb)-eps);
+	*c1 = col_of(fmax(xa, xb)+eps);
+}
+
+
+/* list each segment in the cells it goes through */
+
+static void index_segs(void)
+{
+	const struct seg *s;
+	uint32_t *pos;
+	unsigned c, r, c0, c1, r0, r1, i;
+
+	cell_first = zalloc_array((size_t) cols*rows+1, sizeof(uint32_t));
+	for (s = segs; s != segs+n_segs; s++) {
+		seg_rows(s, &r0, &r1);
+		for (r = r0; r <= r1; r++) {
+			seg_cols(s, r, &c0, &c1);
+			for (c = c0; c <= c1; c++)
+				cell_first[r*cols+c+1]++;
+		}
+	}
+	for (i = 0; i != cols*rows; i++)
+		cell_first[i+1] += cell_first[i];
+
+	cell_segs = zalloc_array(cell_first[cols*rows], sizeof(uint32_t));
+	pos = zalloc_array(cols*rows, sizeof(uint32_t));
+	memcpy(pos, cell_first, sizeof(uint32_t)*cols*rows);
+	for (s = segs; s != segs+n_segs; s++) {
+		seg_rows(s, &r0, &r1);
+		for (r = r0; r <= r1; r++) {
+			seg_cols(s, r, &c0, &c1);
+			for (c = c0; c <= c1; c++)
+				cell_segs[pos[r*cols+c]++] = s-segs;
+		}
+	}
+	free(pos);
+}
+
+
+/* crossings of the line at "y" within cell "c" of its row, and right of "x" */
+
+static unsigned cell_crossings(unsigned r, unsigned c, double x, double y)
+{
+	unsigned i = r*cols+c, n = 0;
+	uint32_t j;
+	double cx;
+
+	for (j = cell_first[i]; j != cell_first[i+1]; j++)
+		if (crossing(segs+cell_segs[j], y, &cx) && cx > x &&
+		    col_of(cx) == c)
+			n++;
+	return n;
+}
+
+
+/*
+ * A cell that no segment touches is either entirely inside or entirely
+ * outside, like its center. We follow the line through the centers of each
+ * row from the right, where everything is outside, and count the crossings.
+ */
+
+static void classify(void)
+{
+	unsigned r, c, i;
+	bool in;
+	double y;
+
+	cells = zalloc_array((size_t) cols*rows, 1);
+	for (r = 0; r != rows; r++) {
+		y = org_y+(r+0.5)/scale;
+		in = 0;
+		for (c = cols; c--; ) {
+			i = r*cols+c;
+			if (cell_first[i] != cell_first[i+1]) {
+				cells[i] = cell_border;
+				in ^= cell_crossings(r, c, -HUGE_VAL, y) & 1;
+			} else {
+				cells[i] = in ? cell_in : cell_out;
+			}
+		}
+	}
+}
+
+
+/* ----- Interface --------------------------------------------------------- */
+
+
+void read_poly(const char *name)
+{
+	FILE *file;
+	double end_x, end_y;
+	unsigned n, border = 0;
+
+	file = fopen(name, "r");
+	if (!file) {
+		perror(name);
+		exit(1);
+	}
+	read_rings(file, name);
+	fclose(file);
+	if (!n_segs) {
+		fprintf(stderr, "%s: empty boundary\n", name);
+		exit(1);
+	}
+
+	bounds(&end_x, &end_y);
+	if (end_x == org_x || end_y == org_y) {
+		fprintf(stderr, "%s: boundary has no area\n", name);
+		exit(1);
+	}
+	scale = GRID/fmax(end_x-org_x, end_y-org_y);
+	cols = (end_x-org_x)*scale+1;
+	rows = (end_y-org_y)*scale+1;
+	index_segs();
+	classify();
+	clipping = 1;
+
+	for (n = 0; n != cols*rows; n++)
+		border += cells[n] == cell_border;
+	fprintf(stderr, "boundary: %u segments, %u x %u cells, %u on it\n",
+	    n_segs, cols, rows, border);
+}
+
+
+bool clip_inside(double lat, double lon)
+{
+	double fx = (lon-org_x)*scale;
+	double fy = (lat-org_y)*scale;
+	unsigned r, c, cc, i;
+	bool in = 0;
+
+	if (fx < 0 || fy < 0 || fx >= cols || fy >= rows)
+		return 0;
+	c = fx;
+	r = fy;
+	if (cells[r*cols+c] != cell_border)
+		return cells[r*cols+c] == cell_in;
+
+	for (cc = c; cc != cols; cc++) {
+		i = r*cols+cc;
+		if (cells[i] != cell_border)
+			return in ^ (cells[i] == cell_in);
+		in ^= cell_crossings(r, cc, lon, lat) & 1;
+	}
+	return in;
+}
@@ -0,0 +1,30 @@
+/*
+ * clip.h - Clipping to a boundary polygon
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CLIP_H
+#define	CLIP_H
+
+#include <stdbool.h>
+
+
+/*
+ * read_poly reads a boundary in the .poly format of Osmosis: a name, then
+ * rings of "lon lat" lines, each ring starting with a name and ending with
+ * "END", and a final "END". Rings whose name begins with "!" are holes.
+ *
+ * Once a boundary is read, "clipping" is set, and clip_inside tells whether a
+ * point is inside it.
+ */
+
+extern bool clipping;
+
+void read_poly(const char *name);
+bool clip_inside(double lat, double lon);
+
+#endif /* CLIP_H */
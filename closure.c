@@ -0,0 +1,321 @@
+/*
+ * closure.c - Redundancy of coverage, and the impact of closing a station
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Instead of one distance per node, we keep the k nearest stations of each
+ * node, as labels of (distance, station), ordered like the tie-breaking of
+ * routing. A single search over (node, station) pairs finds them all: we
+ * settle pairs in the order of their labels, and a node stops accepting
+ * labels once it has k of them. This is exact, since a station that is among
+ * the k nearest of a node is also among the k nearest of the node before it
+ * on the path.
+ *
+ * If a station closes, each node it served falls back to its next label. With
+ * k >= 2, this is the exact distance without that station.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "util.h"
+#include "heap.h"
+#include "profile.h"
+#include "db.h"
+#include "route.h"
+#include "stats.h"
+#include "closure.h"
+
+
+static unsigned k;
+
+static uint16_t *l_d;		/* k labels per node, nearest first */
+static int32_t *l_station;
+static uint8_t *n_labels;
+
+static uint32_t *stations;	/* station -> node */
+static unsigned n_stations;
+
+static double depth[MAX_K+1];	/* road length by stations in reach */
+static double (*impact)[bands];	/* change per station and band */
+
+
+/* ----- Multi-label search ------------------------------------------------ */
+
+
+/* key: distance << 32 | station, val: node */
+
+static struct heap heap;
+
+
+static void push(unsigned n, int d, int station)
+{
+	heap_push(&heap, (uint64_t) d << 32 | (uint32_t) station, n);
+}
+
+
+/* whether node "n" has no room for a label of "station" */
+
+static bool full(unsigned n, int station)
+{
+	unsigned i;
+
+	if (n_labels[n] == k)
+		return 1;
+	for (i = 0; i != n_labels[n]; i++)
+		if (l_station[n*k+i] == station)
+			return 1;
+	return 0;
+}
+
+
+static void search(void)
+{
+	struct heap_entry top;
+	unsigned s, n, m;
+	uint32_t e;
+	int d, station;
+
+	for (s = 0; s != n_stations; s++) {
+		n = stations[s];
+		for (m = 0; m != n_nodes; m++) {
+			if (edge_first[m] == edge_first[m+1])
+				continue;
+			d = hypot(node_x[n]-node_x[m], node_y[n]-node_y[m]);
+			if (d <= NEAR)
+				push(m, d, s);
+		}
+	}
+
+	while (heap.n) {
+		top = heap_pop(&heap);
+		n = top.val;
+		d = top.key >> 32;
+		station = (int32_t) top.key;
+		if (full(n, station))
+			continue;
+		l_d[n*k+n_labels[n]] = d;
+		l_station[n*k+n_labels[n]] = station;
+		n_labels[n]++;
+		for (e = edge_first[n]; e != edge_first[n+1]; e++) {
+			m = edge_to[e];
+			if (d+edge_len[e] < UNREACHABLE && !full(m, station))
+				push(m, d+edge_len[e], station);
+		}
+	}
+}
+
+
+/* distance to the nearest station other than "skip" */
+
+static int nearest(unsigned n, int skip)
+{
+	unsigned i;
+
+	for (i = 0; i != n_labels[n]; i++)
+		if (l_station[n*k+i] != skip)
+			return l_d[n*k+i];
+	return UNREACHABLE;
+}
+
+
+/* distance to "station", UNREACHABLE if it is not among the labels */
+
+static int distance_to(unsigned n, int station)
+{
+	unsigned i;
+
+	for (i = 0; i != n_labels[n]; i++)
+		if (l_station[n*k+i] == station)
+			return l_d[n*k+i];
+	return UNREACHABLE;
+}
+
+
+/* ----- Bands ------------------------------------------------------------- */
+
+
+static void close_station(unsigned a, unsigned b, int len, double scale,
+    const double *before, int station)
+{
+	double after[bands] = { 0 };
+	unsigned i;
+
+	stats_bands(after, nearest(a, station), nearest(b, station), len,
+	    scale);
+	for (i = 0; i != bands; i++)
+		impact[station][i] += after[i]-before[i];
+}
+
+
+/*
+ * Only the stations that are nearest at either end of a segment serve any
+ * part of it, so only closing one of them changes its bands.
+ */
+
+static void closure_edge(unsigned a, unsigned b, int len, double scale)
+{
+	double before[bands] = { 0 };
+	int sa, sb;
+
+	sa = n_labels[a] ? l_station[a*k] : -1;
+	sb = n_labels[b] ? l_station[b*k] : -1;
+	stats_bands(before, nearest(a, -1), nearest(b, -1), len, scale);
+	if (sa >= 0)
+		close_station(a, b, len, scale, before, sa);
+	if (sb >= 0 && sb != sa)
+		close_station(a, b, len, scale, before, sb);
+}
+
+
+/* ----- Redundancy -------------------------------------------------------- */
+
+
+struct event {
+	double pos;
+	int delta;
+};
+
+
+static int event_comp(const void *a, const void *b)
+{
+	const struct event *ea = a, *eb = b;
+
+	return ea->pos < eb->pos ? -1 : ea->pos > eb->pos;
+}
+
+
+static void add_reach(struct event *ev, unsigned *n, double from, double to)
+{
+	if (to <= from)
+		return;
+	ev[*n].pos = from;
+	ev[(*n)++].delta = 1;
+	ev[*n].pos = to;
+	ev[(*n)++].delta = -1;
+}
+
+
+/*
+ * Station "s" reaches the points of the segment that are less than
+ * UNREACHABLE from it, coming from either end. The k nearest stations of each
+ * point are among those of the two ends, so counting these stations is exact
+ * up to k.
+ */
+
+static void depth_edge(unsigned a, unsigned b, int len, double scale)
+{
+	struct event ev[4*2*MAX_K];
+	int s[2*MAX_K];
+	unsigned n_s = 0, n_ev = 0;
+	unsigned i, j, level = 0;
+	double ra, rb, pos = 0;
+
+	for (i = 0; i != n_labels[a]; i++)
+		s[n_s++] = l_station[a*k+i];
+	for (i = 0; i != n_labels[b]; i++) {
+		for (j = 0; j != n_labels[a]; j++)
+			if (s[j] == l_station[b*k+i])
+				break;
+		if (j == n_labels[a])
+			s[n_s++] = l_station[b*k+i];
+	}
+
+	for (i = 0; i != n_s; i++) {
+		ra = UNREACHABLE-distance_to(a, s[i]);
+		rb = UNREACHABLE-distance_to(b, s[i]);
+		if (ra+rb >= len) {
+			add_reach(ev, &n_ev, 0, len);
+		} else {
+			add_reach(ev, &n_ev, 0, ra);
+			add_reach(ev, &n_ev, len-rb, len);
+		}
+	}
+	qsort(ev, n_ev, sizeof(struct event), event_comp);
+
+	for (i = 0; i != n_ev; i++) {
+		depth[level < k ? level : k] += (ev[i].pos-pos)*scale;
+		pos = ev[i].pos;
+		level += ev[i].delta;
+	}
+	depth[level < k ? level : k] += (len-pos)*scale;
+}
+
+
+/* ----- Output ------------------------------------------------------------ */
+
+
+/* don't print rounding noise as "-0" */
+
+static double tidy(double v)
+{
+	return fabs(v) < 0.5 ? 0 : v;
+}
+
+
+void write_closure(FILE *file, unsigned max)
+{
+	double sum = 0;
+	unsigned n, m, s, i;
+	uint32_t e;
+
+	k = max;
+	n_stations = count_routes();
+	stations = station_nodes();
+
+	l_d = alloc_array((size_t) n_nodes*k, sizeof(uint16_t));
+	l_station = alloc_array((size_t) n_nodes*k, sizeof(int32_t));
+	n_labels = calloc(n_nodes, 1);
+	impact = calloc(n_stations, sizeof(*impact));
+	if (!n_labels || (n_stations && !impact)) {
+		perror("calloc");
+		exit(1);
+	}
+
+	search();
+
+	for (n = 0; n != n_nodes; n++)
+		for (e = edge_first[n]; e != edge_first[n+1]; e++) {
+			m = edge_to[e];
+			if (node_id[m] <= node_id[n] || !edge_len[e])
+				continue;
+			closure_edge(n, m, edge_len[e],
+			    1/profile_cost(edge_class[e]));
+			depth_edge(n, m, edge_len[e],
+			    1/profile_cost(edge_class[e]));
+		}
+
+	for (i = 0; i <= k; i++)
+		sum += depth[i];
+	fprintf(file, "# stations within %u m, length(m) percent\n",
+	    UNREACHABLE);
+	for (i = 0; i <= k; i++)
+		fprintf(file, "%u%s %.0f %.2f\n", i, i == k ? "+" : "",
+		    depth[i], sum ? depth[i]*100/sum : 0);
+
+	fprintf(file, "\n# change of road length if the station closes\n");
+	fprintf(file, "# station x y good(m) average(m) bad(m) remote(m)\n");
+	for (s = 0; s != n_stations; s++) {
+		n = stations[s];
+		fprintf(file, "%d %d %d %.0f %.0f %.0f %.0f\n",
+		    node_id[n], node_x[n], node_y[n],
+		    tidy(impact[s][band_good]), tidy(impact[s][band_average]),
+		    tidy(impact[s][band_bad]), tidy(impact[s][band_remote]));
+	}
+
+	free(l_d);
+	free(l_station);
+	free(n_labels);
+	free(impact);
+	free(stations);
+	heap_free(&heap);
+}
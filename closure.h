@@ -0,0 +1,27 @@
+/*
+ * closure.h - Redundancy of coverage, and the impact of closing a station
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CLOSURE_H
+#define	CLOSURE_H
+
+#include <stdio.h>
+
+
+#define	MAX_K		16	/* labels per node */
+
+
+/*
+ * Find the k nearest stations of each node, with k >= 2, and write how much
+ * road length has 0, 1, ..., k or more stations in reach, and, for each
+ * station, how the road length in each band changes if it closes.
+ */
+
+void write_closure(FILE *file, unsigned k);
+
+#endif /* CLOSURE_H */
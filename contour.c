@@ -0,0 +1,753 @@
+/*
+ * contour.c - Polygons of the distance bands
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * We build the Delaunay triangulation of the nodes ourselves (Bowyer-Watson,
+ * with exact integer predicates), inserting the nodes in their order along
+ * the Hilbert curve, so that finding the triangle of the next node is
+ * usually only a few steps.
+ *
+ * The distance is interpolated linearly within each triangle, as when
+ * painting them. The levels are half a meter off the band limits, so that
+ * no node, with its integer distance, is ever exactly on a level, and the
+ * inside of each band is the same as for classify(). Marching triangles then
+ * gives, for each triangle and level, the border of the part inside: a
+ * segment through the triangle, and the parts of edges on the hull. We
+ * direct each segment such that the inside is on its left, and chain them
+ * into rings by their end points. End points are either nodes or crossings
+ * of an edge, which both have an exact key, so there is no need to match
+ * coordinates.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+#include "db.h"
+#include "route.h"
+#include "stats.h"
+#include "parallel.h"
+#include "contour.h"
+
+
+#define	NONE	UINT32_MAX
+#define	FAR	100000000	/* corners of the initial triangle (m) */
+#define	BLOCK	4096		/* triangles per job */
+#define	LEVELS	3
+
+
+static const double level[LEVELS] = {
+	BAND_GOOD+0.5,
+	BAND_AVERAGE+0.5,
+	BAND_BAD-0.5,		/* "bad" ends before BAND_BAD */
+};
+
+/* vertices: the nodes, without duplicates, then the initial triangle */
+
+static int *vx, *vy;
+static uint16_t *vd;
+static uint32_t n_vertices;
+
+static struct tri {
+	uint32_t v[3];		/* counter-clockwise */
+	uint32_t nb[3];		/* neighbour opposite v[i] */
+} *tris;
+static uint32_t n_tris, tris_size;
+
+static uint32_t *free_tris;
+static uint32_t n_free;
+
+static uint32_t *mark;		/* last insertion that visited a triangle */
+
+
+/* ----- Vertices ---------------------------------------------------------- */
+
+
+struct vertex {
+	uint32_t n;		/* first node at this position */
+	uint16_t d;		/* smallest distance of the nodes there */
+};
+
+
+static int pos_comp(const void *a, const void *b)
+{
+	uint32_t na = ((const struct vertex *) a)->n;
+	uint32_t nb = ((const struct vertex *) b)->n;
+
+	if (node_x[na] != node_x[nb])
+		return node_x[na] < node_x[nb] ? -1 : 1;
+	if (node_y[na] != node_y[nb])
+		return node_y[na] < node_y[nb] ? -1 : 1;
+	return na < nb ? -1 : na > nb;
+}
+
+
+static int node_comp(const void *a, const void *b)
+{
+	uint32_t na = ((const struct vertex *) a)->n;
+	uint32_t nb = ((const struct vertex *) b)->n;
+
+	return na < nb ? -1 : na > nb;
+}
+
+
+/*
+ * Nodes at the same position become one vertex, with the smallest distance.
+ * The vertices stay in node order.
+ */
+
+static void make_vertices(void)
+{
+	struct vertex *v;
+	uint32_t n, i, j, k = 0;
+	int64_t xmin = 0, xmax = 0, ymin = 0, ymax = 0;
+
+	v = alloc_array(n_nodes, sizeof(struct vertex));
+	for (n = 0; n != n_nodes; n++)
+		if (edge_first[n] != edge_first[n+1]) {
+			v[k].n = n;
+			v[k++].d = node_distance[n];
+		}
+	qsort(v, k, sizeof(struct vertex), pos_comp);
+
+	n_vertices = 0;
+	for (i = 0; i != k; i = j) {
+		v[n_vertices] = v[i];
+		for (j = i+1; j != k && node_x[v[j].n] == node_x[v[i].n] &&
+		    node_y[v[j].n] == node_y[v[i].n]; j++)
+			if (v[j].d < v[n_vertices].d)
+				v[n_vertices].d = v[j].d;
+		n_vertices++;
+	}
+	qsort(v, n_vertices, sizeof(struct vertex), node_comp);
+
+	vx = alloc_array(n_vertices+3, sizeof(int));
+	vy = alloc_array(n_vertices+3, sizeof(int));
+	vd = alloc_array(n_vertices+3, sizeof(uint16_t));
+	for (i = 0; i != n_vertices; i++) {
+		vx[i] = node_x[v[i].n];
+		vy[i] = node_y[v[i].n];
+		vd[i] = v[i].d;
+		if (!i || vx[i] < xmin)
+			xmin = vx[i];
+		if (!i || vx[i] > xmax)
+			xmax = vx[i];
+		if (!i || vy[i] < ymin)
+			ymin = vy[i];
+		if (!i || vy[i] > ymax)
+			ymax = vy[i];
+	}
+	free(v);
+
+	vx[n_vertices] = (xmin+xmax)/2-FAR;
+	vy[n_vertices] = (ymin+ymax)/2-FAR;
+	vx[n_vertices+1] = (xmin+xmax)/2+FAR;
+	vy[n_vertices+1] = (ymin+ymax)/2-FAR;
+	vx[n_vertices+2] = (xmin+xmax)/2;
+	vy[n_vertices+2] = (ymin+ymax)/2+FAR;
+	vd[n_vertices] = vd[n_vertices+1] = vd[n_vertices+2] = UNREACHABLE;
+}
+
+
+/* ----- Predicates -------------------------------------------------------- */
+
+
+/* > 0 if "c" is left of a->b */
+
+static int64_t orient(uint32_t a, uint32_t b, uint32_t c)
+{
+	return ((int64_t) vx[b]-vx[a])*((int64_t) vy[c]-vy[a])-
+	    ((int64_t) vy[b]-vy[a])*((int64_t) vx[c]-vx[a]);
+}
+
+
+/*
+ * Coordinate differences, even to the initial triangle, are below 2^28, so
+ * the squares and the 2x2 determinants of in_circle fit in an int64_t, but
+ * their products need up to 116 bits. We evaluate the sum in double first,
+ * which decides all but the nearly cocircular cases, and only then do it
+ * exactly, in two's complement on two 64-bit words.
+ */
+
+struct wide {
+	uint64_t hi, lo;
+};
+
+
+static struct wide mul_wide(int64_t a, int64_t b)
+{
+	uint64_t ua = a < 0 ? -(uint64_t) a : (uint64_t) a;
+	uint64_t ub = b < 0 ? -(uint64_t) b : (uint64_t) b;
+	uint64_t a0 = ua & 0xffffffff, a1 = ua >> 32;
+	uint64_t b0 = ub & 0xffffffff, b1 = ub >> 32;
+	uint64_t p00 = a0*b0, p01 = a0*b1, p10 = a1*b0, p11 = a1*b1;
+	uint64_t mid = (p00 >> 32)+(p01 & 0xffffffff)+(p10 & 0xffffffff);
+	struct wide r;
+
+	r.lo = (mid << 32) | (p00 & 0xffffffff);
+	r.hi = p11+(p01 >> 32)+(p10 >> 32)+(mid >> 32);
+	if ((a < 0) != (b < 0)) {
+		r.lo = ~r.lo+1;
+		r.hi = ~r.hi+!r.lo;
+	}
+	return r;
+}
+
+
+static struct wide add_wide(struct wide a, struct wide b)
+{
+	struct wide r;
+
+	r.lo = a.lo+b.lo;
+	r.hi = a.hi+b.hi+(r.lo < a.lo);
+	return r;
+}
+
+
+/* whether "p" is strictly inside the circumcircle of triangle "t" */
+
+static bool in_circle(const struct tri *t, uint32_t p)
+{
+	int64_t adx = vx[t->v[0]]-vx[p], ady = vy[t->v[0]]-vy[p];
+	int64_t bdx = vx[t->v[1]]-vx[p], bdy = vy[t->v[1]]-vy[p];
+	int64_t cdx = vx[t->v[2]]-vx[p], cdy = vy[t->v[2]]-vy[p];
+	int64_t alift = adx*adx+ady*ady, bc = bdx*cdy-cdx*bdy;
+	int64_t blift = bdx*bdx+bdy*bdy, ca = cdx*ady-adx*cdy;
+	int64_t clift = cdx*cdx+cdy*cdy, ab = adx*bdy-bdx*ady;
+	double det, bound;
+	struct wide sum;
+
+	/* rounding makes each term off by less than 2^-50 of its size */
+	det = (double) alift*bc+(double) blift*ca+(double) clift*ab;
+	bound = ((double) alift*llabs(bc)+(double) blift*llabs(ca)+
+	    (double) clift*llabs(ab))*1e-15;
+	if (det > bound)
+		return 1;
+	if (det < -bound)
+		return 0;
+
+	sum = add_wide(add_wide(mul_wide(alift, bc), mul_wide(blift, ca)),
+	    mul_wide(clift, ab));
+	return (int64_t) sum.hi > 0 || (!sum.hi && sum.lo);
+}
+
+
+/* ----- Triangulation ----------------------------------------------------- */
+
+
+static uint32_t new_tri(uint32_t a, uint32_t b, uint32_t c)
+{
+	uint32_t t;
+
+	if (n_free) {
+		t = free_tris[--n_free];
+	} else {
+		if (n_tris == tris_size) {
+			tris_size = tris_size ? 2*tris_size : 1024;
+			tris = realloc(tris, sizeof(struct tri)*tris_size);
+			mark = realloc(mark, sizeof(uint32_t)*tris_size);
+			free_tris = realloc(free_tris,
+			    sizeof(uint32_t)*tris_size);
+			if (!tris || !mark || !free_tris) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		t = n_tris++;
+	}
+	tris[t].v[0] = a;
+	tris[t].v[1] = b;
+	tris[t].v[2] = c;
+	tris[t].nb[0] = tris[t].nb[1] = tris[t].nb[2] = NONE;
+	mark[t] = NONE;
+	return t;
+}
+
+
+/* walk towards "p", crossing any edge that has "p" on its other side */
+
+static uint32_t locate(uint32_t t, uint32_t p)
+{
+	const struct tri *tri;
+	unsigned i;
+
+	while (1) {
+		tri = tris+t;
+		for (i = 0; i != 3; i++)
+			if (orient(tri->v[(i+1) % 3], tri->v[(i+2) % 3],
+			    p) < 0)
+				break;
+		if (i == 3)
+			return t;
+		t = tri->nb[i];
+	}
+}
+
+
+struct border {
+	uint32_t a, b;		/* edge of the cavity, counter-clockwise */
+	uint32_t outer;		/* triangle on the other side, or NONE */
+	uint32_t t;		/* new triangle (a, b, p) */
+};
+
+static uint32_t *cavity;
+static struct border *borders;
+static uint32_t cavity_size, borders_size;
+
+
+static void add_cavity(uint32_t *n, uint32_t t, uint32_t p)
+{
+	if (*n == cavity_size) {
+		cavity_size = cavity_size ? 2*cavity_size : 64;
+		cavity = realloc(cavity, sizeof(uint32_t)*cavity_size);
+		if (!cavity) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	cavity[(*n)++] = t;
+	mark[t] = p;
+}
+
+
+static void add_border(uint32_t *n, uint32_t a, uint32_t b, uint32_t outer)
+{
+	if (*n == borders_size) {
+		borders_size = borders_size ? 2*borders_size : 64;
+		borders = realloc(borders, sizeof(struct border)*borders_size);
+		if (!borders) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	borders[*n].a = a;
+	borders[*n].b = b;
+	borders[*n].outer = outer;
+	(*n)++;
+}
+
+
+/*
+ * The cavity is made of the triangles whose circumcircle contains "p". If
+ * "p" is not strictly left of an edge of the cavity, e.g., because points
+ * are on a common circle, we also add the triangle on the other side, so
+ * that no new triangle is degenerate.
+ */
+
+static uint32_t find_cavity(uint32_t start, uint32_t p, uint32_t *n_borders)
+{
+	uint32_t n = 0, done = 0, i, t, nb, a, b;
+	unsigned j;
+
+again:
+	if (!n)
+		add_cavity(&n, start, p);
+	for (; done != n; done++) {
+		t = cavity[done];
+		for (j = 0; j != 3; j++) {
+			nb = tris[t].nb[j];
+			if (nb != NONE && mark[nb] != p &&
+			    in_circle(tris+nb, p))
+				add_cavity(&n, nb, p);
+		}
+	}
+
+	*n_borders = 0;
+	for (i = 0; i != n; i++) {
+		t = cavity[i];
+		for (j = 0; j != 3; j++) {
+			nb = tris[t].nb[j];
+			if (nb != NONE && mark[nb] == p)
+				continue;
+			a = tris[t].v[(j+1) % 3];
+			b = tris[t].v[(j+2) % 3];
+			if (orient(a, b, p) <= 0 && nb != NONE) {
+				add_cavity(&n, nb, p);
+				goto again;
+			}
+			add_border(n_borders, a, b, nb);
+		}
+	}
+	return n;
+}
+
+
+static void relink(uint32_t outer, uint32_t a, uint32_t b, uint32_t t)
+{
+	struct tri *o = tris+outer;
+	unsigned j;
+
+	for (j = 0; j != 3; j++)
+		if (o->v[(j+1) % 3] == b && o->v[(j+2) % 3] == a) {
+			o->nb[j] = t;
+			return;
+		}
+	abort();
+}
+
+
+static uint32_t insert(uint32_t start, uint32_t p)
+{
+	struct border *bd;
+	uint32_t n, n_borders, i, j;
+
+	n = find_cavity(locate(start, p), p, &n_borders);
+	for (i = 0; i != n; i++) {
+		tris[cavity[i]].v[0] = NONE;
+		free_tris[n_free++] = cavity[i];
+	}
+
+	for (i = 0; i != n_borders; i++) {
+		bd = borders+i;
+		bd->t = new_tri(bd->a, bd->b, p);
+		tris[bd->t].nb[2] = bd->outer;
+		if (bd->outer != NONE)
+			relink(bd->outer, bd->a, bd->b, bd->t);
+	}
+
+	/* the border is a cycle, so each "b" is the "a" of another edge */
+	for (i = 0; i != n_borders; i++)
+		for (j = 0; j != n_borders; j++)
+			if (borders[j].a == borders[i].b) {
+				tris[borders[i].t].nb[0] = borders[j].t;
+				tris[borders[j].t].nb[1] = borders[i].t;
+				break;
+			}
+	return borders[0].t;
+}
+
+
+static void triangulate(void)
+{
+	uint32_t t, p;
+	unsigned i;
+
+	n_tris = n_free = 0;
+	t = new_tri(n_vertices, n_vertices+1, n_vertices+2);
+	for (p = 0; p != n_vertices; p++)
+		t = insert(t, p);
+
+	/* drop the triangles of the initial corners, and unused slots */
+	for (t = 0; t != n_tris; t++)
+		if (tris[t].v[0] != NONE && (tris[t].v[0] >= n_vertices ||
+		    tris[t].v[1] >= n_vertices || tris[t].v[2] >= n_vertices))
+			tris[t].v[0] = NONE;
+	for (t = 0; t != n_tris; t++)
+		if (tris[t].v[0] != NONE)
+			for (i = 0; i != 3; i++)
+				if (tris[t].nb[i] != NONE &&
+				    tris[tris[t].nb[i]].v[0] == NONE)
+					tris[t].nb[i] = NONE;
+
+	free(free_tris);
+	free(cavity);
+	free(borders);
+	free(mark);
+	free_tris = cavity = mark = NULL;
+	borders = NULL;
+	cavity_size = borders_size = 0;
+}
+
+
+/* ----- Marching triangles ------------------------------------------------ */
+
+
+/*
+ * A point on a ring is either vertex "a", with the key (a, a), or where the
+ * level crosses the edge between "a" and "b", with a < b.
+ */
+
+static inline uint64_t vertex_key(uint32_t a)
+{
+	return (uint64_t) a << 32 | a;
+}
+
+
+static inline uint64_t cross_key(uint32_t a, uint32_t b)
+{
+	return a < b ? (uint64_t) a << 32 | b : (uint64_t) b << 32 | a;
+}
+
+
+struct seg {
+	uint64_t from, to;
+};
+
+static struct segs {
+	struct seg *seg;
+	uint32_t n, size;
+} (*segs)[LEVELS];		/* per thread and level */
+
+static uint32_t next_block;
+
+
+static void add_seg(struct segs *s, uint64_t from, uint64_t to)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? 2*s->size : 1024;
+		s->seg = realloc(s->seg, sizeof(struct seg)*s->size);
+		if (!s->seg) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->seg[s->n].from = from;
+	s->seg[s->n].to = to;
+	s->n++;
+}
+
+
+static void march(struct segs *s, const struct tri *t, double l)
+{
+	uint64_t exit_key = 0, enter_key = 0;
+	uint32_t p, q;
+	bool in_p, in_q, hull;
+	unsigned i, inside = 0;
+
+	for (i = 0; i != 3; i++)
+		inside += vd[t->v[i]] < l;
+	if (!inside)
+		return;
+
+	for (i = 0; i != 3; i++) {
+		p = t->v[i];
+		q = t->v[(i+1) % 3];
+		in_p = vd[p] < l;
+		in_q = vd[q] < l;
+		hull = t->nb[(i+2) % 3] == NONE;
+		if (in_p && in_q) {
+			if (hull)
+				add_seg(s, vertex_key(p), vertex_key(q));
+		} else if (in_p) {
+			exit_key = cross_key(p, q);
+			if (hull)
+				add_seg(s, vertex_key(p), exit_key);
+		} else if (in_q) {
+			enter_key = cross_key(p, q);
+			if (hull)
+				add_seg(s, enter_key, vertex_key(q));
+		}
+	}
+	if (inside != 3)
+		add_seg(s, exit_key, enter_key);
+}
+
+
+static void march_blocks(void *user, unsigned thread)
+{
+	uint32_t b, t, end;
+	unsigned l;
+
+	while (1) {
+		b = next_job(&next_block);
+		if ((uint64_t) b*BLOCK >= n_tris)
+			break;
+		end = (uint64_t) (b+1)*BLOCK < n_tris ? (b+1)*BLOCK : n_tris;
+		for (t = b*BLOCK; t != end; t++) {
+			if (tris[t].v[0] == NONE)
+				continue;
+			for (l = 0; l != LEVELS; l++)
+				march(segs[thread]+l, tris+t, level[l]);
+		}
+	}
+}
+
+
+/* ----- Rings ------------------------------------------------------------- */
+
+
+static struct rings {
+	struct seg *seg;	/* all segments of the level, by "from" */
+	uint32_t n;
+	uint32_t *next;		/* following segment in the ring */
+	bool *start;		/* first segment of a ring */
+	uint32_t n_rings;
+} rings[LEVELS];
+
+static uint32_t next_level;
+
+
+static int seg_comp(const void *a, const void *b)
+{
+	const struct seg *sa = a, *sb = b;
+
+	if (sa->from != sb->from)
+		return sa->from < sb->from ? -1 : 1;
+	return sa->to < sb->to ? -1 : sa->to > sb->to;
+}
+
+
+/* first segment starting at "key" that isn't in a ring yet */
+
+static uint32_t find_from(const struct rings *r, const bool *used,
+    uint64_t key)
+{
+	uint32_t lo = 0, hi = r->n, mid;
+
+	while (lo != hi) {
+		mid = (lo+hi)/2;
+		if (r->seg[mid].from < key)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	while (lo != r->n && r->seg[lo].from == key && used[lo])
+		lo++;
+	return lo != r->n && r->seg[lo].from == key ? lo : NONE;
+}
+
+
+static void link_level(struct rings *r)
+{
+	bool *used;
+	uint32_t i, s, next;
+
+	qsort(r->seg, r->n, sizeof(struct seg), seg_comp);
+	r->next = alloc_array(r->n, sizeof(uint32_t));
+	r->start = calloc(r->n, sizeof(bool));
+	used = calloc(r->n, sizeof(bool));
+	if (r->n && (!r->start || !used)) {
+		perror("calloc");
+		exit(1);
+	}
+
+	r->n_rings = 0;
+	for (i = 0; i != r->n; i++) {
+		if (used[i])
+			continue;
+		r->start[i] = 1;
+		r->n_rings++;
+		s = i;
+		used[s] = 1;
+		while (1) {
+			next = find_from(r, used, r->seg[s].to);
+			if (next == NONE) {
+				/* back at the start, or a broken ring */
+				r->next[s] = i;
+				break;
+			}
+			used[next] = 1;
+			r->next[s] = next;
+			s = next;
+		}
+	}
+	free(used);
+}
+
+
+static void link_levels(void *user, unsigned thread)
+{
+	uint32_t l;
+
+	while (1) {
+		l = next_job(&next_level);
+		if (l >= LEVELS)
+			break;
+		link_level(rings+l);
+	}
+}
+
+
+/* ----- Output ------------------------------------------------------------ */
+
+
+static void point(FILE *file, uint64_t key, double l)
+{
+	uint32_t a = key >> 32, b = key;
+	double t;
+
+	if (a == b) {
+		fprintf(file, "%d %d\n", vx[a], vy[a]);
+		return;
+	}
+	t = (l-vd[a])/(vd[b]-vd[a]);
+	fprintf(file, "%.1f %.1f\n",
+	    vx[a]+t*(vx[b]-vx[a]), vy[a]+t*(vy[b]-vy[a]));
+}
+
+
+static void write_level(FILE *file, const struct rings *r, double l)
+{
+	uint32_t i, s;
+
+	for (i = 0; i != r->n; i++) {
+		if (!r->start[i])
+			continue;
+		s = i;
+		do {
+			point(file, r->seg[s].from, l);
+			s = r->next[s];
+		} while (s != i);
+		point(file, r->seg[i].from, l);
+		fprintf(file, "\n");
+	}
+}
+
+
+void write_contours(FILE *file)
+{
+	uint32_t th, t, l, points = 0;
+	struct rings *r;
+
+	make_vertices();
+	triangulate();
+
+	segs = calloc(threads, sizeof(*segs));
+	if (!segs) {
+		perror("calloc");
+		exit(1);
+	}
+	next_block = 0;
+	parallel(march_blocks, NULL);
+
+	for (l = 0; l != LEVELS; l++) {
+		r = rings+l;
+		r->n = 0;
+		for (th = 0; th != threads; th++)
+			r->n += segs[th][l].n;
+		r->seg = alloc_array(r->n, sizeof(struct seg));
+		r->n = 0;
+		for (th = 0; th != threads; th++) {
+			memcpy(r->seg+r->n, segs[th][l].seg,
+			    sizeof(struct seg)*segs[th][l].n);
+			r->n += segs[th][l].n;
+			free(segs[th][l].seg);
+		}
+	}
+	free(segs);
+
+	next_level = 0;
+	parallel(link_levels, NULL);
+
+	for (l = 0; l != LEVELS; l++) {
+		r = rings+l;
+		fprintf(file, "%s# distance < %.1f m, %u rings\n",
+		    l ? "\n\n" : "", level[l], r->n_rings);
+		write_level(file, r, level[l]);
+		points += r->n;
+		free(r->seg);
+		free(r->next);
+		free(r->start);
+	}
+
+	for (t = l = 0; t != n_tris; t++)
+		l += tris[t].v[0] != NONE;
+	fprintf(stderr, "%u triangles, %u contour points\n", l, points);
+
+	free(tris);
+	tris = NULL;
+	n_tris = tris_size = 0;
+	free(vx);
+	free(vy);
+	free(vd);
+}
@@ -0,0 +1,26 @@
+/*
+ * contour.h - Polygons of the distance bands
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef CONTOUR_H
+#define	CONTOUR_H
+
+#include <stdio.h>
+
+
+/*
+ * Triangulate the nodes of the network, like r/r.c does, and write the area
+ * within each band limit (good, average, bad) as polygons. Each polygon is a
+ * closed ring of "x y" lines, followed by an empty line. Outer rings are
+ * counter-clockwise, holes clockwise. The levels are separated by two empty
+ * lines, so that gnuplot can select them with "index".
+ */
+
+void write_contours(FILE *file);
+
+#endif /* CONTOUR_H */
@@ -22,30 +22,58 @@
 #include <expat.h>
 #include <glib.h>
 
+#include "util.h"
 #include "local.h"
+#include "clip.h"
+#include "profile.h"
+#include "extsort.h"
 #include "db.h"
+#include "route.h"
 
 
 #define	EARTH_R	(6378137/2+6356752/2)	/* meters, (equatorial+polar)/2 */
 
 
-struct node nodes[MAX_NODES];
-unsigned n_nodes;
+int *node_id;
+int *node_x, *node_y;
+int32_t *node_lat, *node_lon;
+uint8_t *node_flags;
 
-static GTree *tree;
-static unsigned n_edges;
-static int verbose = 0;
+uint16_t *node_distance;
+int32_t *node_nearest;
+
+uint32_t *edge_first;
+uint32_t *edge_to;
+uint16_t *edge_len;
+uint8_t *edge_class;
+uint8_t *edge_access;
+uint8_t *edge_foot;
 
+unsigned n_nodes, n_edges;
 
-/* ----- Helper functions -------------------------------------------------- */
+struct line *lines;
+uint32_t *line_stops;
+unsigned n_lines, n_line_stops;
 
+size_t mem_budget = 0;
 
-#define	alloc_type(t) (t *) malloc(sizeof(t))
+static GTree *tree;	/* node ID -> node number + 1 */
+static unsigned nodes_size;	/* in-memory build */
+static int verbose = 0;
 
 
 /* ----- Handlers ---------------------------------------------------------- */
 
 
+/*
+ * Handlers live on a fixed stack, one per level of XML nesting. A handler
+ * function is only ever called from "start", so make_handler can simply
+ * fill in the next level.
+ */
+
+#define	MAX_DEPTH	16	/* OSM files don't nest deeper than 3 */
+
+
 typedef struct handler *(*handler_fn)(void *obj, const char *name,
     const char **attr);
 
@@ -53,16 +81,18 @@ static struct handler {
 	handler_fn fn;
 	void (*end)(void *obj);
 	void *obj;
-	struct handler *prev;
-} *handler;
+} stack[MAX_DEPTH], *handler = stack;
 
 
 static struct handler *make_handler(handler_fn fn, void (*end)(void *obj),
     void *obj)
 {
-	struct handler *h;
+	struct handler *h = handler+1;
 
-	h = alloc_type(struct handler);
+	if (h == stack+MAX_DEPTH) {
+		fprintf(stderr, "XML nesting deeper than %d\n", MAX_DEPTH);
+		exit(1);
+	}
 	h->fn = fn;
 	h->end = end;
 	h->obj = obj;
@@ -73,11 +103,33 @@ static struct handler *make_handler(handler_fn fn, void (*end)(void *obj),
 /* ----- Nodes ------------------------------------------------------------- */
 
 
+/*
+ * The tree keys are the IDs themselves, not pointers into node_id, so that
+ * the node arrays can grow while we parse.
+ */
+
 static int node_comp(gconstpointer a, gconstpointer b)
 {
-	const struct node *na = a, *nb = b;
-	
-	return na->id - nb->id;
+	int ia = GPOINTER_TO_INT(a), ib = GPOINTER_TO_INT(b);
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+
+static void grow_nodes(void)
+{
+	nodes_size = nodes_size ? 2*nodes_size : 65536;
+	node_id = realloc(node_id, sizeof(int)*nodes_size);
+	node_x = realloc(node_x, sizeof(int)*nodes_size);
+	node_y = realloc(node_y, sizeof(int)*nodes_size);
+	node_lat = realloc(node_lat, sizeof(int32_t)*nodes_size);
+	node_lon = realloc(node_lon, sizeof(int32_t)*nodes_size);
+	node_flags = realloc(node_flags, nodes_size);
+	if (!node_id || !node_x || !node_y || !node_lat || !node_lon ||
+	    !node_flags) {
+		perror("realloc");
+		exit(1);
+	}
 }
 
 
@@ -86,24 +138,30 @@ static int node_comp(gconstpointer a, gconstpointer b)
  * of latitude.
  */
 
-static void map_coord(struct node *n, double lat, double lon)
+void map_point(double lat, double lon, int *x, int *y)
 {
 	double lat_deg_m, lon_deg_m;	/* meters per degree */
 
 	lat_deg_m = EARTH_R/180.0*M_PI;
 	lon_deg_m = EARTH_R/180.0*M_PI*cos(lat/180.0*M_PI);
 
-	n->x = (lon-lon_min)*lon_deg_m;
-	n->y = (lat-lat_min)*lat_deg_m;
+	*x = (lon-lon_min)*lon_deg_m;
+	*y = (lat-lat_min)*lat_deg_m;
+}
+
+
+static void map_coord(unsigned n, double lat, double lon)
+{
+	map_point(lat, lon, node_x+n, node_y+n);
 }
 
 
 static struct handler *node_handler(void *obj, const char *name,
     const char **attr)
 {
-	struct node *n = obj;
+	uint8_t *flags = obj;
 
-	if (n->station)
+	if (*flags & NODE_STATION)
 		return NULL;
 	if (strcmp(name, "tag"))
 		return NULL;
@@ -112,33 +170,30 @@ static struct handler *node_handler(void *obj, const char *name,
 		if (!strcmp(attr[0], "v") &&
 		    (!strcmp(attr[1], "subway") ||
 		    !strcmp(attr[1], "subway_entrance"))) {
-			n->station = 1;
+			*flags |= NODE_STATION;
 			break;
 		}
 		if (!strcmp(attr[0], "proposed") ||
 		    !strcmp(attr[1], "proposed"))
-			n->proposed = 1;
+			*flags |= NODE_PROPOSED;
 		attr += 2;
 	}
 	return NULL;
 }
 
 
+static struct handler *ext_node(int id, double lat, double lon);
+
+
 static struct handler *node(const char **attr)
 {
 	double lat = 0, lon = 0;
-	struct node *n;
-
-// dynamic allocation would be cleaner but then we have to recalculate all the
-// "way" pointers. Let's do this later :)
-//	nodes = realloc(nodes, sizeof(struct node) * (n_nodes+1));
-	n = nodes + n_nodes;
-
-	memset(n, 0, sizeof(*n));
+	unsigned n = n_nodes;
+	int id = 0;
 
 	while (*attr) {
 		if (!strcmp(attr[0], "id"))
-			n->id = atoi(attr[1]);
+			id = atoi(attr[1]);
 		else if (!strcmp(attr[0], "lat"))
 			lat = atof(attr[1]);
 		else if (!strcmp(attr[0], "lon"))
@@ -154,73 +209,121 @@ static struct handler *node(const char **attr)
 		return NULL;
 	if (lat > lat_max)
 		return NULL;
+	if (clipping && !clip_inside(lat, lon))
+		return NULL;
 
+	if (mem_budget)
+		return ext_node(id, lat, lon);
+
+	if (n_nodes == nodes_size)
+		grow_nodes();
+
+	node_id[n] = id;
+	node_lat[n] = lround(lat*1e7);
+	node_lon[n] = lround(lon*1e7);
+	node_flags[n] = 0;
 	map_coord(n, lat, lon);
 
-	g_tree_insert(tree, &n->id, n);
+	g_tree_insert(tree, GINT_TO_POINTER(id), GUINT_TO_POINTER(n+1));
 	n_nodes++;
 
-	return make_handler(node_handler, NULL, n);
+	return make_handler(node_handler, NULL, node_flags+n);
 }
 
 
 /* ----- Ways -------------------------------------------------------------- */
 
 
-static struct vertex {
-	struct node *node;
-	struct vertex *prev;	/* we reverse the order */
-} *vertices;
+/* nodes of the current way, reused for all ways */
+
+#define	NO_NODE	UINT32_MAX
 
-static bool keep;	/* keep in the street database */
+static uint32_t *way_nodes;
+static unsigned n_way_nodes, way_nodes_size;
+
+static enum token way_highway, way_access, way_foot;
 static bool subway;	/* the "way" is a subway entrance/station */
 
+/*
+ * While parsing, we just collect the directed edges of all highways. They
+ * are sorted into the compressed sparse row arrays when we're done, and the
+ * walking profile only decides later which of them we keep.
+ */
+
+static struct link {
+	uint32_t a, b;
+	uint8_t cls, access, foot;
+} *links;
+static unsigned n_links, links_size;
 
-static void link_nodes(struct node *a, struct node *b)
-{
-	struct edge *e;
 
-	for (e = a->edges; e != a->edges+a->n_edges; e++)
-		if (e->n == b) {
-			if (verbose)
-				fprintf(stderr,
-				    "ignoring redundant edge %d -> %d\n",
-				    a->id, b->id);
-			return;
+static void ext_link(int a, int b, enum token cls, enum token access,
+    enum token foot);
+static void ext_station(int id);
+
+
+void link_nodes(unsigned a, unsigned b, uint8_t cls, uint8_t access,
+    uint8_t foot)
+{
+	if (n_links == links_size) {
+		links_size = links_size ? 2*links_size : 1024*1024;
+		links = realloc(links, sizeof(struct link)*links_size);
+		if (!links) {
+			perror("realloc");
+			exit(1);
 		}
-	a->edges = realloc(a->edges, sizeof(struct edge) * (a->n_edges + 1));
-	a->edges[a->n_edges++].n = b;
-	n_edges++;
+	}
+	links[n_links].a = a;
+	links[n_links].b = b;
+	links[n_links].cls = cls;
+	links[n_links].access = access;
+	links[n_links].foot = foot;
+	n_links++;
+}
+
+
+/* with the external build, "a" and "b" are node IDs */
+
+static void add_link(unsigned a, unsigned b)
+{
+	if (mem_budget)
+		ext_link(a, b, way_highway, way_access, way_foot);
+	else
+		link_nodes(a, b, way_highway, way_access, way_foot);
 }
 
 
 static struct handler *way_handler(void *obj, const char *name,
     const char **attr)
 {
-	struct node *node;
-	struct vertex *v;
+	gpointer node;
 	int ref = 0;
 
 	if (!strcmp(name, "tag")) {
-		if (keep)
-			return NULL;
+		enum token key = tok_other, value = tok_other;
+
 		while (*attr) {
-#if 0
-			if (!strcmp(attr[0], "v") &&
-			    !strcmp(attr[1], "subway")) {
-#elif 1
-			if (!strcmp(attr[0], "k") &&
-			    !strcmp(attr[1], "highway")) {
-#endif
-				keep = 1;
-				break;
-			}
-			if (!strcmp(attr[0], "v") &&
-			    !strcmp(attr[1], "subway_entrance")) {
-				subway = 1;
-			}
+			if (!strcmp(attr[0], "k"))
+				key = intern(attr[1]);
+			else if (!strcmp(attr[0], "v"))
+				value = intern(attr[1]);
 			attr += 2;
 		}
+		switch (key) {
+		case tok_highway:
+			way_highway = value;
+			break;
+		case tok_access:
+			way_access = value;
+			break;
+		case tok_foot:
+			way_foot = value;
+			break;
+		default:
+			break;
+		}
+		if (value == tok_subway_entrance)
+			subway = 1;
 		return NULL;
 	}
 
@@ -235,50 +338,213 @@ static struct handler *way_handler(void *obj, const char *name,
 		attr += 2;
 	}
 
-	node = g_tree_lookup(tree, &ref);
-	if (!node) {
-		if (verbose)
+	/* the external build only finds out later which nodes we have */
+	if (mem_budget) {
+		node = GUINT_TO_POINTER((uint32_t) ref+1);
+	} else {
+		node = g_tree_lookup(tree, GINT_TO_POINTER(ref));
+		if (!node && verbose)
 			fprintf(stderr, "unknown node %d\n", ref);
-		return NULL;
+		if (!node && !clipping)
+			return NULL;
 	}
 
-	v = alloc_type(struct vertex);
-	v->node = node;
-	v->prev = vertices;
-	vertices = v;
+	if (n_way_nodes == way_nodes_size) {
+		way_nodes_size = way_nodes_size ? 2*way_nodes_size : 1024;
+		way_nodes = realloc(way_nodes,
+		    sizeof(uint32_t)*way_nodes_size);
+		if (!way_nodes) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	way_nodes[n_way_nodes++] = node ? GPOINTER_TO_UINT(node)-1 : NO_NODE;
 
 	return NULL;
 }
 
 
+/*
+ * We link from the end of the way, which is the order in which the edges
+ * were always added. Without a boundary, nodes we don't have are simply
+ * skipped and the way bridges the gap. When clipping, they are NO_NODE and
+ * the way is broken there, like in the external build, so that we don't
+ * leap across the part that was cut away.
+ */
+
 static void end_way(void *obj)
 {
-	struct vertex *v, *prev;
-
-	if (keep)
-		for (v = vertices; v && v->prev; v = v->prev) {
-			link_nodes(v->node, v->prev->node);
-			link_nodes(v->prev->node, v->node);
+	unsigned i;
+
+	if (way_highway != tok_none)
+		for (i = n_way_nodes; i > 1; i--) {
+			if (way_nodes[i-1] == NO_NODE ||
+			    way_nodes[i-2] == NO_NODE)
+				continue;
+			add_link(way_nodes[i-1], way_nodes[i-2]);
+			add_link(way_nodes[i-2], way_nodes[i-1]);
+		}
+	if (subway)
+		for (i = 0; i != n_way_nodes; i++) {
+			if (way_nodes[i] == NO_NODE)
+				continue;
+			if (mem_budget)
+				ext_station(way_nodes[i]);
+			else
+				node_flags[way_nodes[i]] |= NODE_STATION;
 		}
-	while (vertices) {
-		if (subway)
-			vertices->node->station = 1;
-		prev = vertices->prev;
-		free(vertices);
-		vertices = prev;
-	}
 }
 
 
 static struct handler *way(const char **attr)
 {
-	vertices = NULL;
-	keep = 0;
+	n_way_nodes = 0;
+	way_highway = way_access = way_foot = tok_none;
 	subway = 0;
 	return make_handler(way_handler, end_way, NULL);
 }
 
 
+/* ----- Relations --------------------------------------------------------- */
+
+
+/*
+ * Nodes come before relations in OSM files, so we can look up the stops
+ * right away. The stops of the current relation are appended to line_stops,
+ * and dropped again if the relation turns out not to be a subway line. The
+ * external build stores node IDs instead, and resolves them at the end.
+ */
+
+static unsigned line_stops_size, lines_size;
+static unsigned relation_first;	/* first stop of the current relation */
+static enum token relation_route;
+static char *relation_ref;
+
+
+static bool stop_role(const char *role)
+{
+	return !strncmp(role, "stop", 4) || strstr(role, ":stop");
+}
+
+
+static void add_stop(unsigned n)
+{
+	if (n_line_stops == line_stops_size) {
+		line_stops_size = line_stops_size ? 2*line_stops_size : 1024;
+		line_stops = realloc(line_stops,
+		    sizeof(uint32_t)*line_stops_size);
+		if (!line_stops) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	line_stops[n_line_stops++] = n;
+}
+
+
+static struct handler *relation_handler(void *obj, const char *name,
+    const char **attr)
+{
+	const char *type = NULL, *role = "";
+	gpointer node;
+	int ref = 0;
+
+	if (!strcmp(name, "tag")) {
+		enum token key = tok_other;
+		const char *value = "";
+
+		while (*attr) {
+			if (!strcmp(attr[0], "k"))
+				key = intern(attr[1]);
+			else if (!strcmp(attr[0], "v"))
+				value = attr[1];
+			attr += 2;
+		}
+		switch (key) {
+		case tok_route:
+			relation_route = intern(value);
+			break;
+		case tok_ref:
+			free(relation_ref);
+			relation_ref = strdup(value);
+			if (!relation_ref) {
+				perror("strdup");
+				exit(1);
+			}
+			break;
+		default:
+			break;
+		}
+		return NULL;
+	}
+
+	if (strcmp(name, "member"))
+		return NULL;
+
+	while (*attr) {
+		if (!strcmp(attr[0], "type"))
+			type = attr[1];
+		else if (!strcmp(attr[0], "ref"))
+			ref = atoi(attr[1]);
+		else if (!strcmp(attr[0], "role"))
+			role = attr[1];
+		attr += 2;
+	}
+	if (!type || strcmp(type, "node") || !stop_role(role))
+		return NULL;
+
+	if (mem_budget) {
+		node = GUINT_TO_POINTER((uint32_t) ref+1);
+	} else {
+		node = g_tree_lookup(tree, GINT_TO_POINTER(ref));
+		if (!node)
+			return NULL;
+	}
+
+	/* the same node may be listed with several stop roles in a row */
+	if (n_line_stops != relation_first &&
+	    line_stops[n_line_stops-1] == GPOINTER_TO_UINT(node)-1)
+		return NULL;
+	add_stop(GPOINTER_TO_UINT(node)-1);
+	return NULL;
+}
+
+
+static void end_relation(void *obj)
+{
+	struct line *l;
+
+	if (relation_route != tok_subway || n_line_stops-relation_first < 2) {
+		n_line_stops = relation_first;
+		free(relation_ref);
+		relation_ref = NULL;
+		return;
+	}
+	if (n_lines == lines_size) {
+		lines_size = lines_size ? 2*lines_size : 64;
+		lines = realloc(lines, sizeof(struct line)*lines_size);
+		if (!lines) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	l = lines+n_lines++;
+	l->ref = relation_ref;
+	l->first = relation_first;
+	l->n = n_line_stops-relation_first;
+	relation_ref = NULL;
+}
+
+
+static struct handler *relation(const char **attr)
+{
+	relation_first = n_line_stops;
+	relation_route = tok_none;
+	relation_ref = NULL;
+	return make_handler(relation_handler, end_relation, NULL);
+}
+
+
 /* ----- OSM handler ------------------------------------------------------- */
 
 
@@ -290,6 +556,8 @@ static struct handler *osm_handler(void *obj, const char *name,
 		return node(attr);
 	if (!strcmp(name, "way"))
 		return way(attr);
+	if (!strcmp(name, "relation"))
+		return relation(attr);
 	return NULL;
 }
 
@@ -321,28 +589,787 @@ static struct handler *top_handler(void *obj, const char *name,
 
 static void start(void *user, const char *name, const char **attr)
 {
-	struct handler *next;
-
-	next = handler->fn(handler->obj, name, attr);
-	if (!next)
-		next = make_handler(null_handler, NULL, NULL);
-	next->prev = handler;
-	handler = next;
+	if (!handler->fn(handler->obj, name, attr))
+		make_handler(null_handler, NULL, NULL);
+	handler++;
 }
 
 
 static void end(void *user, const char *name)
 {
-	struct handler *prev;
-
 	if (handler->end)
 		handler->end(handler->obj);
-	prev = handler->prev;
-	free(handler);
-	handler = prev;
+	handler--;
+}
+
+
+
+/* ----- Edges ------------------------------------------------------------- */
+
+
+/*
+ * Sort the links by their first node, preserving the order in which they were
+ * found, and drop exact duplicates, i.e., those that also have the same tags.
+ * The adjacency order thus stays the same as when each node had its own edge
+ * list.
+ */
+
+static bool same_edge(uint32_t i, uint32_t j)
+{
+	return edge_to[i] == edge_to[j] && edge_class[i] == edge_class[j] &&
+	    edge_access[i] == edge_access[j] && edge_foot[i] == edge_foot[j];
+}
+
+
+void make_edges(void)
+{
+	uint32_t *next;
+	const struct link *l;
+	uint32_t i, j, e;
+	unsigned n;
+
+	edge_first = calloc(n_nodes+1, sizeof(uint32_t));
+	edge_to = malloc(sizeof(uint32_t)*n_links);
+	edge_class = malloc(n_links);
+	edge_access = malloc(n_links);
+	edge_foot = malloc(n_links);
+	if (!edge_first || (n_links &&
+	    (!edge_to || !edge_class || !edge_access || !edge_foot))) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (l = links; l != links+n_links; l++)
+		edge_first[l->a+1]++;
+	for (n = 0; n != n_nodes; n++)
+		edge_first[n+1] += edge_first[n];
+
+	next = malloc(sizeof(uint32_t)*(n_nodes+1));
+	if (!next) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(next, edge_first, sizeof(uint32_t)*(n_nodes+1));
+	for (l = links; l != links+n_links; l++) {
+		edge_class[next[l->a]] = l->cls;
+		edge_access[next[l->a]] = l->access;
+		edge_foot[next[l->a]] = l->foot;
+		edge_to[next[l->a]++] = l->b;
+	}
+	free(next);
+	free(links);
+	links = NULL;
+	n_links = links_size = 0;
+
+	e = 0;
+	for (n = 0; n != n_nodes; n++) {
+		i = edge_first[n];
+		edge_first[n] = e;
+		for (; i != edge_first[n+1]; i++) {
+			for (j = edge_first[n]; j != e; j++)
+				if (same_edge(i, j))
+					break;
+			if (j != e)
+				continue;
+			edge_class[e] = edge_class[i];
+			edge_access[e] = edge_access[i];
+			edge_foot[e] = edge_foot[i];
+			edge_to[e++] = edge_to[i];
+		}
+	}
+	edge_first[n_nodes] = e;
+	n_edges = e;
+}
+
+
+/*
+ * Drop the edges the walking profile doesn't keep. Of parallel edges, we keep
+ * the first one, with the cheapest highway class of all of them.
+ */
+
+void select_edges(void)
+{
+	uint32_t i, j, e;
+	unsigned n;
+
+	e = 0;
+	for (n = 0; n != n_nodes; n++) {
+		i = edge_first[n];
+		edge_first[n] = e;
+		for (; i != edge_first[n+1]; i++) {
+			if (!profile_keep(edge_class[i], edge_access[i],
+			    edge_foot[i]))
+				continue;
+			for (j = edge_first[n]; j != e; j++)
+				if (edge_to[j] == edge_to[i])
+					break;
+			if (j != e) {
+				if (profile_cost(edge_class[i]) <
+				    profile_cost(edge_class[j]))
+					edge_class[j] = edge_class[i];
+				if (verbose)
+					fprintf(stderr,
+					    "ignoring redundant edge "
+					    "%d -> %d\n",
+					    node_id[n], node_id[edge_to[i]]);
+				continue;
+			}
+			edge_class[e] = edge_class[i];
+			edge_to[e++] = edge_to[i];
+		}
+	}
+	edge_first[n_nodes] = e;
+	n_edges = e;
+
+	free(edge_access);
+	free(edge_foot);
+	edge_access = edge_foot = NULL;
+
+	edge_to = realloc(edge_to, sizeof(uint32_t)*n_edges);
+	edge_class = realloc(edge_class, n_edges);
+	edge_len = malloc(sizeof(uint16_t)*n_edges);
+	if (n_edges && (!edge_to || !edge_class || !edge_len)) {
+		perror("malloc");
+		exit(1);
+	}
+}
+
+
+/* ----- Bounds ------------------------------------------------------------ */
+
+
+static void bounds(const int *x, const int *y, bool all,
+    int *xmin, int *xmax, int *ymin, int *ymax)
+{
+	bool first = 1;
+	unsigned n;
+
+	*xmin = *xmax = *ymin = *ymax = 0;
+	for (n = 0; n != n_nodes; n++) {
+		if (!all && edge_first[n] == edge_first[n+1] && !eligible(n))
+			continue;
+		if (first || x[n] < *xmin)
+			*xmin = x[n];
+		if (first || x[n] > *xmax)
+			*xmax = x[n];
+		if (first || y[n] < *ymin)
+			*ymin = y[n];
+		if (first || y[n] > *ymax)
+			*ymax = y[n];
+		first = 0;
+	}
+}
+
+
+void graph_bounds(int *xmin, int *xmax, int *ymin, int *ymax)
+{
+	bounds(node_x, node_y, 0, xmin, xmax, ymin, ymax);
+}
+
+
+void node_extent(int32_t *lon_lo, int32_t *lon_hi, int32_t *lat_lo,
+    int32_t *lat_hi)
+{
+	bounds(node_lon, node_lat, 1, lon_lo, lon_hi, lat_lo, lat_hi);
+}
+
+
+/* ----- Networks ---------------------------------------------------------- */
+
+
+/*
+ * Road networks that no station can reach, e.g., driveways, parking lots, or
+ * fragments cut off by the bounding box, would never get a distance, but they
+ * would still be contracted, routed over, and written out. We find the
+ * networks with union-find, and drop those that have no node within NEAR of
+ * an eligible station, or less than min_net_length meters of road. Stations
+ * and stops are always kept, even if they lose all their edges.
+ *
+ * The nodes that remain keep their order, and so do their edges.
+ */
+
+bool prune_nets = 0;
+unsigned min_net_length = 0;
+
+
+static uint32_t find_net(uint32_t *parent, uint32_t n)
+{
+	while (parent[n] != n) {
+		parent[n] = parent[parent[n]];
+		n = parent[n];
+	}
+	return n;
+}
+
+
+/*
+ * We sort the nodes into cells of NEAR x NEAR meters, so that each station
+ * only has to look at the nodes in its own and the eight surrounding cells.
+ */
+
+static void reach_nets(const uint32_t *net, bool *reached)
+{
+	int xmin, xmax, ymin, ymax;
+	uint32_t cols, rows, cells, c, r, c0, c1, r0, r1, i, n, m;
+	uint32_t *cell, *first, *nodes;
+	int d;
+
+	bounds(node_x, node_y, 1, &xmin, &xmax, &ymin, &ymax);
+	cols = (xmax-xmin)/NEAR+1;
+	rows = (ymax-ymin)/NEAR+1;
+	cells = cols*rows;
+
+	cell = alloc_array(n_nodes, sizeof(uint32_t));
+	first = zalloc_array(cells+1, sizeof(uint32_t));
+	for (n = 0; n != n_nodes; n++) {
+		cell[n] = (node_y[n]-ymin)/NEAR*cols+(node_x[n]-xmin)/NEAR;
+		first[cell[n]+1]++;
+	}
+	for (i = 0; i != cells; i++)
+		first[i+1] += first[i];
+	nodes = alloc_array(n_nodes, sizeof(uint32_t));
+	for (n = 0; n != n_nodes; n++)
+		nodes[first[cell[n]]++] = n;
+	for (i = cells; i; i--)
+		first[i] = first[i-1];
+	first[0] = 0;
+
+	for (n = 0; n != n_nodes; n++) {
+		if (!eligible(n))
+			continue;
+		c = cell[n] % cols;
+		r = cell[n] / cols;
+		c0 = c ? c-1 : 0;
+		c1 = c+1 < cols ? c+1 : c;
+		r0 = r ? r-1 : 0;
+		r1 = r+1 < rows ? r+1 : r;
+		for (r = r0; r <= r1; r++)
+			for (i = first[r*cols+c0]; i != first[r*cols+c1+1];
+			    i++) {
+				m = nodes[i];
+				d = hypot(node_x[n]-node_x[m],
+				    node_y[n]-node_y[m]);
+				if (d <= NEAR)
+					reached[net[m]] = 1;
+			}
+	}
+	free(cell);
+	free(first);
+	free(nodes);
+}
+
+
+static void mark_nets(uint32_t *net, bool *reached, double *length)
+{
+	uint32_t n, a, b, e;
+
+	for (n = 0; n != n_nodes; n++)
+		net[n] = n;
+	for (n = 0; n != n_nodes; n++)
+		for (e = edge_first[n]; e != edge_first[n+1]; e++) {
+			a = find_net(net, n);
+			b = find_net(net, edge_to[e]);
+			if (a != b)
+				net[a < b ? b : a] = a < b ? a : b;
+		}
+	for (n = 0; n != n_nodes; n++)
+		net[n] = find_net(net, n);
+
+	/* each segment has an edge in each direction */
+	for (n = 0; n != n_nodes; n++)
+		for (e = edge_first[n]; e != edge_first[n+1]; e++)
+			length[net[n]] += hypot(node_x[n]-node_x[edge_to[e]],
+			    node_y[n]-node_y[edge_to[e]])/2;
+
+	reach_nets(net, reached);
+}
+
+
+#define	KEEP_NODE	1	/* stations and stops, at least */
+#define	KEEP_EDGES	2	/* the network is kept */
+
+
+static void prune(void)
+{
+	uint32_t *net;
+	bool *reached;
+	uint8_t *keep;
+	double *length;
+	uint32_t n, i, start, end, e = 0, kept = 0;
+	unsigned nets = 0, dropped = 0;
+
+	net = malloc(sizeof(uint32_t)*n_nodes);
+	reached = calloc(n_nodes, sizeof(bool));
+	keep = calloc(n_nodes, 1);
+	length = calloc(n_nodes, sizeof(double));
+	if (n_nodes && (!net || !reached || !keep || !length)) {
+		perror("malloc");
+		exit(1);
+	}
+	mark_nets(net, reached, length);
+
+	for (n = 0; n != n_nodes; n++) {
+		if (reached[net[n]] && length[net[n]] >= min_net_length)
+			keep[n] = KEEP_NODE | KEEP_EDGES;
+		else if (node_flags[n] & NODE_STATION)
+			keep[n] = KEEP_NODE;
+		if (net[n] != n || edge_first[n] == edge_first[n+1])
+			continue;
+		nets++;
+		if (!(keep[n] & KEEP_EDGES))
+			dropped++;
+	}
+	for (i = 0; i != n_line_stops; i++)
+		keep[line_stops[i]] |= KEEP_NODE;
+
+	/* "net" becomes the new number of each node we keep */
+	for (n = 0; n != n_nodes; n++)
+		if (keep[n])
+			net[n] = kept++;
+
+	start = edge_first[0];
+	kept = 0;
+	for (n = 0; n != n_nodes; n++) {
+		end = edge_first[n+1];
+		if (!keep[n]) {
+			start = end;
+			continue;
+		}
+		node_id[kept] = node_id[n];
+		node_x[kept] = node_x[n];
+		node_y[kept] = node_y[n];
+		node_lat[kept] = node_lat[n];
+		node_lon[kept] = node_lon[n];
+		node_flags[kept] = node_flags[n];
+		edge_first[kept] = e;
+		if (keep[n] & KEEP_EDGES)
+			for (i = start; i != end; i++) {
+				edge_to[e] = net[edge_to[i]];
+				edge_class[e++] = edge_class[i];
+			}
+		start = end;
+		kept++;
+	}
+	edge_first[kept] = e;
+
+	for (i = 0; i != n_line_stops; i++)
+		line_stops[i] = net[line_stops[i]];
+
+	fprintf(stderr, "dropped %u of %u networks, %u nodes\n",
+	    dropped, nets, n_nodes-kept);
+	n_nodes = kept;
+	n_edges = e;
+
+	free(net);
+	free(reached);
+	free(keep);
+	free(length);
+}
+
+
+/* ----- External build --------------------------------------------------- */
+
+
+/*
+ * With a memory budget, we don't keep nodes in memory while parsing. Nodes
+ * go to a sorted run by ID, and links to a sorted run by the ID of the node
+ * they lead to. Merging the two then tells us which nodes are used by any
+ * link, and gives us the number of the node at the end of each link. Nodes
+ * that are not used, which are most of them, never take up memory.
+ *
+ * The links whose end we found go to a third run, by their position in the
+ * parse order. Once all the nodes are in memory, we read them back, resolve
+ * their start, and only keep the links that have both ends. Links to nodes
+ * we don't have therefore never take up memory either.
+ *
+ * Unlike the in-memory build, we don't know whether a node is inside the
+ * bounding box when we see a way. Links to nodes outside are dropped later,
+ * which breaks the way at the gap, like end_way does when clipping.
+ */
+
+struct ext_node {
+	int id;
+	int x, y;
+	int32_t lat, lon;
+	uint8_t flags;
+};
+
+struct ext_link {
+	int a, b;		/* node IDs */
+	uint32_t seq;		/* position in the parse order */
+	uint8_t cls, access, foot;
+};
+
+struct ext_end {
+	int a;			/* node ID */
+	uint32_t b;		/* node number */
+	uint32_t seq;
+	uint8_t cls, access, foot;
+};
+
+
+static struct ext_sort *node_sort, *link_sort, *end_sort;
+static struct ext_node ext_cur;	/* node we're parsing */
+
+static int *ext_ids;		/* nodes of subway entrances, and stops */
+static unsigned n_ext_ids, ext_ids_size;
+static unsigned n_ext_stations;	/* the first ones are the entrances */
+
+
+static int ext_node_comp(const void *a, const void *b)
+{
+	const struct ext_node *na = a, *nb = b;
+
+	return na->id < nb->id ? -1 : na->id > nb->id;
+}
+
+
+static int ext_link_comp(const void *a, const void *b)
+{
+	const struct ext_link *la = a, *lb = b;
+
+	if (la->b != lb->b)
+		return la->b < lb->b ? -1 : 1;
+	return la->seq < lb->seq ? -1 : la->seq > lb->seq;
+}
+
+
+static int ext_end_comp(const void *a, const void *b)
+{
+	const struct ext_end *ea = a, *eb = b;
+
+	return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+
+static int id_comp(const void *a, const void *b)
+{
+	int ia = *(const int *) a, ib = *(const int *) b;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+
+static void end_ext_node(void *obj)
+{
+	ext_sort_add(node_sort, &ext_cur);
+}
+
+
+static struct handler *ext_node(int id, double lat, double lon)
+{
+	ext_cur.id = id;
+	ext_cur.lat = lround(lat*1e7);
+	ext_cur.lon = lround(lon*1e7);
+	ext_cur.flags = 0;
+	map_point(lat, lon, &ext_cur.x, &ext_cur.y);
+	return make_handler(node_handler, end_ext_node, &ext_cur.flags);
+}
+
+
+static void ext_link(int a, int b, enum token cls, enum token access,
+    enum token foot)
+{
+	struct ext_link l = {
+		.a	= a,
+		.b	= b,
+		.seq	= n_links++,
+		.cls	= cls,
+		.access	= access,
+		.foot	= foot,
+	};
+
+	ext_sort_add(link_sort, &l);
 }
 
 
+static void add_ext_id(int id)
+{
+	if (n_ext_ids == ext_ids_size) {
+		ext_ids_size = ext_ids_size ? 2*ext_ids_size : 1024;
+		ext_ids = realloc(ext_ids, sizeof(int)*ext_ids_size);
+		if (!ext_ids) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	ext_ids[n_ext_ids++] = id;
+}
+
+
+static void ext_station(int id)
+{
+	add_ext_id(id);
+	n_ext_stations++;
+}
+
+
+static bool in_ids(const int *ids, unsigned n, int id)
+{
+	return bsearch(&id, ids, n, sizeof(int), id_comp);
+}
+
+
+static void add_node(const struct ext_node *node, uint8_t flags)
+{
+	static unsigned size = 0;
+
+	if (n_nodes == size) {
+		size = size ? 2*size : 1024*1024;
+		node_id = realloc(node_id, sizeof(int)*size);
+		node_x = realloc(node_x, sizeof(int)*size);
+		node_y = realloc(node_y, sizeof(int)*size);
+		node_lat = realloc(node_lat, sizeof(int32_t)*size);
+		node_lon = realloc(node_lon, sizeof(int32_t)*size);
+		node_flags = realloc(node_flags, size);
+		if (!node_id || !node_x || !node_y || !node_lat || !node_lon ||
+		    !node_flags) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	node_id[n_nodes] = node->id;
+	node_x[n_nodes] = node->x;
+	node_y[n_nodes] = node->y;
+	node_lat[n_nodes] = node->lat;
+	node_lon[n_nodes] = node->lon;
+	node_flags[n_nodes] = node->flags | flags;
+	n_nodes++;
+}
+
+
+/* node IDs are sorted, so we can search them */
+
+static bool find_node(int id, uint32_t *n)
+{
+	const int *p;
+
+	p = bsearch(&id, node_id, n_nodes, sizeof(int), id_comp);
+	if (!p)
+		return 0;
+	*n = p-node_id;
+	return 1;
+}
+
+
+static void resolve_lines(void)
+{
+	struct line *l;
+	unsigned i, n = 0, stops = 0, first;
+	uint32_t node;
+
+	for (l = lines; l != lines+n_lines; l++) {
+		first = stops;
+		for (i = l->first; i != l->first+l->n; i++)
+			if (find_node(line_stops[i], &node))
+				line_stops[stops++] = node;
+		if (stops-first < 2) {
+			stops = first;
+			free(l->ref);
+			continue;
+		}
+		lines[n].ref = l->ref;
+		lines[n].first = first;
+		lines[n].n = stops-first;
+		n++;
+	}
+	n_lines = n;
+	n_line_stops = stops;
+}
+
+
+static void ext_build(void)
+{
+	const struct ext_node *node;
+	const struct ext_link *l;
+	const struct ext_end *e;
+	struct ext_end end;
+	unsigned i;
+	uint32_t a;
+	bool used;
+
+	ext_sort_finish(node_sort);
+	ext_sort_finish(link_sort);
+
+	/*
+	 * Stops are kept, even if no way leads to them. Subway entrances are
+	 * sorted separately, since they also get the station flag.
+	 */
+	qsort(ext_ids, n_ext_stations, sizeof(int), id_comp);
+	for (i = 0; i != n_line_stops; i++)
+		add_ext_id(line_stops[i]);
+	qsort(ext_ids+n_ext_stations, n_ext_ids-n_ext_stations, sizeof(int),
+	    id_comp);
+
+	n_links = 0;
+	l = ext_sort_next(link_sort);
+	while ((node = ext_sort_next(node_sort))) {
+		while (l && l->b < node->id)
+			l = ext_sort_next(link_sort);
+		used = 0;
+		while (l && l->b == node->id) {
+			end.a = l->a;
+			end.b = n_nodes;
+			end.seq = l->seq;
+			end.cls = l->cls;
+			end.access = l->access;
+			end.foot = l->foot;
+			ext_sort_add(end_sort, &end);
+			used = 1;
+			l = ext_sort_next(link_sort);
+		}
+		if (in_ids(ext_ids, n_ext_stations, node->id))
+			add_node(node, NODE_STATION);
+		else if (used || node->flags & NODE_STATION ||
+		    in_ids(ext_ids+n_ext_stations, n_ext_ids-n_ext_stations,
+		    node->id))
+			add_node(node, 0);
+	}
+	ext_sort_free(node_sort);
+	ext_sort_free(link_sort);
+	free(ext_ids);
+
+	/* now that we have all the nodes, we can also resolve the start */
+	ext_sort_finish(end_sort);
+	while ((e = ext_sort_next(end_sort)))
+		if (find_node(e->a, &a))
+			link_nodes(a, e->b, e->cls, e->access, e->foot);
+	ext_sort_free(end_sort);
+
+	resolve_lines();
+}
+
+
+/* ----- Node order -------------------------------------------------------- */
+
+
+/*
+ * Nodes are in file order, i.e., usually by ID, which has little to do with
+ * where they are. We sort them along a Hilbert curve, so that nodes close to
+ * each other are usually also close in memory.
+ */
+
+struct order {
+	uint64_t key;
+	uint32_t n;
+};
+
+
+static uint64_t hilbert(uint32_t x, uint32_t y)
+{
+	uint64_t d = 0;
+	uint32_t s, rx, ry, tmp;
+
+	for (s = 1u << 31; s; s >>= 1) {
+		rx = (x & s) != 0;
+		ry = (y & s) != 0;
+		d += (uint64_t) s*s*((3*rx) ^ ry);
+		if (ry)
+			continue;
+		if (rx) {
+			x = ~x;
+			y = ~y;
+		}
+		tmp = x;
+		x = y;
+		y = tmp;
+	}
+	return d;
+}
+
+
+static int order_comp(const void *a, const void *b)
+{
+	const struct order *oa = a, *ob = b;
+
+	if (oa->key != ob->key)
+		return oa->key < ob->key ? -1 : 1;
+	return oa->n < ob->n ? -1 : oa->n > ob->n;
+}
+
+
+static void permute(void *array, size_t size, const struct order *order,
+    void *tmp)
+{
+	uint32_t i;
+
+	for (i = 0; i != n_nodes; i++)
+		memcpy((uint8_t *) tmp+i*size,
+		    (const uint8_t *) array+order[i].n*size, size);
+	memcpy(array, tmp, n_nodes*size);
+}
+
+
+/*
+ * Only nodes that have a link, and stations and stops, are on the curve. The
+ * other ones go to the end, and don't move its origin. The external build
+ * doesn't even keep most of them, so this way both builds put the nodes we
+ * use in the same order.
+ */
+
+static void reorder_nodes(void)
+{
+	struct order *order;
+	uint32_t *rank;
+	void *tmp;
+	int xmin = 0, ymin = 0;
+	bool first = 1;
+	unsigned n, i;
+
+	order = malloc(sizeof(struct order)*n_nodes);
+	rank = malloc(sizeof(uint32_t)*n_nodes);
+	tmp = malloc(sizeof(int)*n_nodes);
+	if (n_nodes && (!order || !rank || !tmp)) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* "rank" is just whether the node is used, for now */
+	for (n = 0; n != n_nodes; n++)
+		rank[n] = node_flags[n] & NODE_STATION;
+	for (i = 0; i != n_links; i++)
+		rank[links[i].a] = rank[links[i].b] = 1;
+	for (i = 0; i != n_line_stops; i++)
+		rank[line_stops[i]] = 1;
+
+	for (n = 0; n != n_nodes; n++) {
+		if (!rank[n])
+			continue;
+		if (first || node_x[n] < xmin)
+			xmin = node_x[n];
+		if (first || node_y[n] < ymin)
+			ymin = node_y[n];
+		first = 0;
+	}
+
+	for (n = 0; n != n_nodes; n++) {
+		order[n].key = rank[n] ?
+		    hilbert(node_x[n]-xmin, node_y[n]-ymin) : UINT64_MAX;
+		order[n].n = n;
+	}
+	qsort(order, n_nodes, sizeof(struct order), order_comp);
+
+	permute(node_id, sizeof(int), order, tmp);
+	permute(node_x, sizeof(int), order, tmp);
+	permute(node_y, sizeof(int), order, tmp);
+	permute(node_lat, sizeof(int32_t), order, tmp);
+	permute(node_lon, sizeof(int32_t), order, tmp);
+	permute(node_flags, sizeof(uint8_t), order, tmp);
+
+	for (i = 0; i != n_nodes; i++)
+		rank[order[i].n] = i;
+	for (i = 0; i != n_links; i++) {
+		links[i].a = rank[links[i].a];
+		links[i].b = rank[links[i].b];
+	}
+	for (i = 0; i != n_line_stops; i++)
+		line_stops[i] = rank[line_stops[i]];
+
+	free(order);
+	free(rank);
+	free(tmp);
+}
+
 
 /* ----- XML parser -------------------------------------------------------- */
 
@@ -370,8 +1397,20 @@ void read_osm_xml(const char *name)
 		exit(1);
 	}
 
-	tree = g_tree_new(node_comp);
-	handler = make_handler(top_handler, NULL, NULL);
+	if (mem_budget) {
+		/* nodes, links, and resolved links each get a third */
+		node_sort = ext_sort_new(sizeof(struct ext_node),
+		    mem_budget/3, ext_node_comp);
+		link_sort = ext_sort_new(sizeof(struct ext_link),
+		    mem_budget/3, ext_link_comp);
+		end_sort = ext_sort_new(sizeof(struct ext_end),
+		    mem_budget/3, ext_end_comp);
+	} else {
+		tree = g_tree_new(node_comp);
+	}
+	handler = stack;
+	handler->fn = top_handler;
+	handler->end = NULL;
 
 	while (1) {
 		got = fread(buf, 1, sizeof(buf), file);
@@ -384,5 +1423,38 @@ void read_osm_xml(const char *name)
 
 	XML_Parse(parser, "", 0, XML_FALSE);
 
-	fprintf(stderr, "%u nodes %u edges\n", n_nodes, n_edges);
+	if (mem_budget) {
+		ext_build();
+	} else {
+		/* node numbers change when we reorder the nodes */
+		g_tree_destroy(tree);
+		tree = NULL;
+	}
+
+	build_graph();
+}
+
+
+void build_graph(void)
+{
+	reorder_nodes();
+	make_edges();
+}
+
+
+void finish_graph(void)
+{
+	select_edges();
+	if (prune_nets)
+		prune();
+
+	node_distance = malloc(sizeof(uint16_t)*n_nodes);
+	node_nearest = malloc(sizeof(int32_t)*n_nodes);
+	if (n_nodes && (!node_distance || !node_nearest)) {
+		perror("malloc");
+		exit(1);
+	}
+
+	fprintf(stderr, "%u nodes %u edges %u lines\n", n_nodes, n_edges,
+	    n_lines);
 }
@@ -13,33 +13,117 @@
 #define	DB_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 
-#define	MAX_NODES	10000000	/* 10 M, big enough for London */
+/* node_flags */
 
+#define	NODE_STATION	(1 << 0)	/* is a subway station */
+#define	NODE_PROPOSED	(1 << 1)	/* not yet in operation */
+#define	NODE_TAG	(1 << 2)	/* already visited when dumping */
 
-struct edge {
-	struct node *n;
-	int len;
-	int tag;
-};
 
-struct node {
-	int id;
-	int x, y;	/* coordinates (m) */
-	bool station;	/* is a subway station */
-	bool proposed;	/* station or line is not yet in operation */
-	int distance;
-	struct edge *edges;
-	int n_edges;
-	int tag;
+/*
+ * Nodes are stored as a structure of arrays, indexed by node number. Routing
+ * only touches the "hot" arrays, so that as many nodes as possible fit into
+ * the cache. Edges are in compressed sparse row form: the edges of node "n"
+ * are edge_first[n] ... edge_first[n+1]-1.
+ */
+
+/* cold: parsing, station capture, and output */
+
+extern int *node_id;
+extern int *node_x, *node_y;		/* coordinates (m) */
+extern int32_t *node_lat, *node_lon;	/* as in OSM, in 1e-7 degrees */
+extern uint8_t *node_flags;
+
+/* hot: routing */
+
+extern uint16_t *node_distance;
+extern int32_t *node_nearest;		/* nearest station, -1 if none */
+
+extern uint32_t *edge_first;
+extern uint32_t *edge_to;
+extern uint16_t *edge_len;	/* weighted by the walking profile */
+extern uint8_t *edge_class;	/* highway class (enum token) */
+extern uint8_t *edge_access;	/* access=..., until finish_graph */
+extern uint8_t *edge_foot;	/* foot=..., until finish_graph */
+
+extern unsigned n_nodes, n_edges;
+
+
+/*
+ * Subway lines, from route=subway relations. The stops of a line are the n
+ * nodes in line_stops, starting at "first", in the order of the relation.
+ * Each direction is usually a line of its own.
+ */
+
+struct line {
+	char *ref;		/* "ref" tag, NULL if there is none */
+	uint32_t first;
+	uint32_t n;
 };
 
+extern struct line *lines;
+extern uint32_t *line_stops;
+extern unsigned n_lines, n_line_stops;
+
+
+/*
+ * If mem_budget (bytes) is not zero, read_osm_xml sorts nodes and ways on
+ * disk, and only keeps the nodes we actually use.
+ */
+
+extern size_t mem_budget;
 
-extern struct node nodes[MAX_NODES];
-extern unsigned n_nodes;
 
+/*
+ * If prune_nets is set, finish_graph drops road networks that no station
+ * can reach, and those with less than min_net_length meters of road.
+ */
+
+extern bool prune_nets;
+extern unsigned min_net_length;
+
+
+/*
+ * graph_bounds finds the bounding box (m) of the nodes in the output, i.e.,
+ * those with edges and the eligible stations. node_extent finds that of all
+ * the nodes, in OSM coordinates. Both are all zero if there are no nodes.
+ */
+
+void graph_bounds(int *xmin, int *xmax, int *ymin, int *ymax);
+void node_extent(int32_t *lon_lo, int32_t *lon_hi, int32_t *lat_lo,
+    int32_t *lat_hi);
+
+
+/* project a point the same way as the nodes */
+
+void map_point(double lat, double lon, int *x, int *y);
 
 void read_osm_xml(const char *name);
 
+/*
+ * Other sources of the graph fill the node arrays and the lines themselves,
+ * add each directed edge with link_nodes, and then call build_graph, like
+ * read_osm_xml does. The graph then has all the highways, with their access
+ * and foot tags, which is what write_store saves. finish_graph applies the
+ * walking profile, merges parallel edges, and drops networks (prune_nets).
+ */
+
+void link_nodes(unsigned a, unsigned b, uint8_t cls, uint8_t access,
+    uint8_t foot);
+void build_graph(void);
+void finish_graph(void);
+
+/*
+ * make_edges only turns the links into edges, for a graph whose nodes are
+ * already in order, and select_edges then applies the profile and merges
+ * parallel edges. Neither touches node_distance and node_nearest.
+ */
+
+void make_edges(void);
+void select_edges(void);
+
 #endif /* DB_H */
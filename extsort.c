@@ -0,0 +1,273 @@
+/*
+ * extsort.c - Sorting more records than fit into memory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extsort.h"
+
+
+#define	MIN_READ	(64*1024)	/* smallest read buffer per run */
+
+
+struct run {
+	off_t pos, end;		/* in the temporary file */
+	uint8_t *buf;
+	size_t n, next;		/* records in "buf", next one to return */
+};
+
+struct ext_sort {
+	size_t size, budget;
+	int (*comp)(const void *a, const void *b);
+
+	uint8_t *buf;		/* records not yet written */
+	size_t n, max;
+
+	FILE *file;
+	off_t written;
+	struct run *runs;
+	unsigned n_runs;
+
+	struct run **heap;	/* runs by their next record */
+	unsigned n_heap;
+	const uint8_t *last;	/* buffer of the record returned last */
+};
+
+
+/* ----- Collecting -------------------------------------------------------- */
+
+
+struct ext_sort *ext_sort_new(size_t size, size_t budget,
+    int (*comp)(const void *a, const void *b))
+{
+	struct ext_sort *s;
+
+	s = calloc(1, sizeof(struct ext_sort));
+	if (!s) {
+		perror("calloc");
+		exit(1);
+	}
+	s->size = size;
+	s->budget = budget;
+	s->comp = comp;
+	s->max = budget/size;
+	if (!s->max)
+		s->max = 1;
+	s->buf = malloc(s->max*size);
+	if (!s->buf) {
+		perror("malloc");
+		exit(1);
+	}
+	return s;
+}
+
+
+static void write_run(struct ext_sort *s)
+{
+	struct run *r;
+
+	if (!s->file) {
+		s->file = tmpfile();
+		if (!s->file) {
+			perror("tmpfile");
+			exit(1);
+		}
+	}
+	qsort(s->buf, s->n, s->size, s->comp);
+	if (fwrite(s->buf, s->size, s->n, s->file) != s->n) {
+		perror("fwrite");
+		exit(1);
+	}
+
+	s->runs = realloc(s->runs, sizeof(struct run)*(s->n_runs+1));
+	if (!s->runs) {
+		perror("realloc");
+		exit(1);
+	}
+	r = s->runs+s->n_runs++;
+	r->pos = s->written;
+	s->written += s->n*s->size;
+	r->end = s->written;
+	s->n = 0;
+}
+
+
+void ext_sort_add(struct ext_sort *s, const void *rec)
+{
+	if (s->n == s->max)
+		write_run(s);
+	memcpy(s->buf+s->n*s->size, rec, s->size);
+	s->n++;
+}
+
+
+/* ----- Merging ----------------------------------------------------------- */
+
+
+static const void *head(const struct run *r, size_t size)
+{
+	return r->buf+r->next*size;
+}
+
+
+static int run_comp(const struct ext_sort *s, unsigned a, unsigned b)
+{
+	return s->comp(head(s->heap[a], s->size), head(s->heap[b], s->size));
+}
+
+
+static void sift_down(struct ext_sort *s, unsigned i)
+{
+	struct run *tmp;
+	unsigned child;
+
+	while (1) {
+		child = 2*i+1;
+		if (child >= s->n_heap)
+			break;
+		if (child+1 < s->n_heap && run_comp(s, child+1, child) < 0)
+			child++;
+		if (run_comp(s, i, child) <= 0)
+			break;
+		tmp = s->heap[i];
+		s->heap[i] = s->heap[child];
+		s->heap[child] = tmp;
+		i = child;
+	}
+}
+
+
+/* returns 0 if the run is exhausted */
+
+static int refill(struct ext_sort *s, struct run *r, size_t max)
+{
+	size_t len = r->end-r->pos;
+	ssize_t got;
+
+	if (len > max*s->size)
+		len = max*s->size;
+	r->n = len/s->size;
+	r->next = 0;
+	while (len) {
+		got = pread(fileno(s->file), r->buf+(r->n*s->size-len), len,
+		    r->pos);
+		if (got <= 0) {
+			perror("pread");
+			exit(1);
+		}
+		r->pos += got;
+		len -= got;
+	}
+	return r->n;
+}
+
+
+/*
+ * If everything fit into the buffer, we don't need a file at all. Otherwise,
+ * we write the rest as the last run, and split the budget among the runs.
+ */
+
+void ext_sort_finish(struct ext_sort *s)
+{
+	size_t per_run;
+	unsigned i;
+
+	if (!s->file) {
+		qsort(s->buf, s->n, s->size, s->comp);
+		s->runs = calloc(1, sizeof(struct run));
+		s->heap = malloc(sizeof(struct run *));
+		if (!s->runs || !s->heap) {
+			perror("malloc");
+			exit(1);
+		}
+		s->runs->buf = s->buf;
+		s->runs->n = s->n;
+		s->buf = NULL;
+		s->n_runs = 1;
+		if (s->runs->n)
+			s->heap[s->n_heap++] = s->runs;
+		return;
+	}
+
+	if (s->n)
+		write_run(s);
+	free(s->buf);
+	s->buf = NULL;
+	if (fflush(s->file) == EOF) {
+		perror("fflush");
+		exit(1);
+	}
+
+	per_run = s->budget/s->n_runs;
+	if (per_run < MIN_READ)
+		per_run = MIN_READ;
+	s->max = per_run/s->size;
+	if (!s->max)
+		s->max = 1;
+
+	s->heap = malloc(sizeof(struct run *)*s->n_runs);
+	if (!s->heap) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i != s->n_runs; i++) {
+		s->runs[i].buf = malloc(s->max*s->size);
+		if (!s->runs[i].buf) {
+			perror("malloc");
+			exit(1);
+		}
+		if (refill(s, s->runs+i, s->max))
+			s->heap[s->n_heap++] = s->runs+i;
+	}
+	for (i = s->n_heap; i; i--)
+		sift_down(s, i-1);
+}
+
+
+/*
+ * The record we return stays valid until the next call. We therefore only
+ * advance past it then.
+ */
+
+const void *ext_sort_next(struct ext_sort *s)
+{
+	struct run *r;
+
+	if (s->last) {
+		r = s->heap[0];
+		if (++r->next == r->n && (!s->file || !refill(s, r, s->max)))
+			s->heap[0] = s->heap[--s->n_heap];
+		if (s->n_heap)
+			sift_down(s, 0);
+		s->last = NULL;
+	}
+	if (!s->n_heap)
+		return NULL;
+	s->last = head(s->heap[0], s->size);
+	return s->last;
+}
+
+
+void ext_sort_free(struct ext_sort *s)
+{
+	unsigned i;
+
+	for (i = 0; i != s->n_runs; i++)
+		free(s->runs[i].buf);
+	free(s->runs);
+	free(s->heap);
+	free(s->buf);
+	if (s->file)
+		fclose(s->file);
+	free(s);
+}
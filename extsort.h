@@ -0,0 +1,33 @@
+/*
+ * extsort.h - Sorting more records than fit into memory
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef EXTSORT_H
+#define	EXTSORT_H
+
+#include <stddef.h>
+
+
+struct ext_sort;
+
+
+/*
+ * Records of "size" bytes are collected in a buffer of at most "budget"
+ * bytes. Whenever it is full, it is sorted and written to a temporary file
+ * as a run. ext_sort_next then merges the runs, returning the records in
+ * order, and NULL when there are no more.
+ */
+
+struct ext_sort *ext_sort_new(size_t size, size_t budget,
+    int (*comp)(const void *a, const void *b));
+void ext_sort_add(struct ext_sort *s, const void *rec);
+void ext_sort_finish(struct ext_sort *s);
+const void *ext_sort_next(struct ext_sort *s);
+void ext_sort_free(struct ext_sort *s);
+
+#endif /* EXTSORT_H */
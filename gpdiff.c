@@ -0,0 +1,788 @@
+/*
+ * gpdiff.c - Compare the distances of two routed maps
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * The input is what subosm writes to stdout. Each segment appears once,
+ * starting at the node with the lower ID, and both of its lines carry the
+ * distance of that node. So we only know the distance of each node that
+ * starts a segment, and of each station, and each segment has the distance
+ * of its first node in both maps, which is also how "plot" colours it.
+ *
+ * Nodes that only end segments, about a third of them, are therefore
+ * missing from the node comparison, unless the node tables subosm writes
+ * with -d are given as well. The nodes then come from these tables, and
+ * only the segments from the maps.
+ *
+ * The files are mapped and parsed in parallel, in chunks that end at empty
+ * lines, or at any line in a node table. Nodes and segments of each map then
+ * go into hash tables, keyed by the OSM ID and by the IDs of both ends, and
+ * each map is looked up in the other, again in parallel. A node or segment
+ * that appears more than once is represented by its first appearance, so
+ * the output does not depend on the threads.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "util.h"
+#include "stats.h"
+#include "parallel.h"
+
+
+#define	CHUNK		(4 << 20)	/* bytes per parsing job */
+#define	BLOCK		4096		/* nodes or segments per join job */
+#define	NONE		UINT32_MAX
+
+
+struct node {
+	int id;
+	int x, y;
+	int d;
+};
+
+struct seg {
+	int a, b;		/* IDs, a < b */
+	int ax, ay, bx, by;
+	int d;			/* of "a" */
+};
+
+struct chunk {
+	const char *from, *to;
+	struct node *nodes;
+	uint32_t n_nodes, nodes_size;
+	struct seg *segs;
+	uint32_t n_segs, segs_size;
+};
+
+struct input {
+	const char *name;
+	bool node_table;	/* "id x y d" lines */
+	bool want_nodes;	/* not only the segments of a map */
+	const char *base;
+	size_t size;
+	struct chunk *chunks;
+	unsigned n_chunks;
+};
+
+struct table {
+	uint64_t *keys;		/* 0 if empty */
+	uint32_t *vals;		/* lowest index with that key */
+	uint64_t mask;
+};
+
+static struct map {
+	const char *name;
+	const char *node_file;	/* node table, NULL if none */
+	struct node *nodes;
+	uint32_t n_nodes;
+	struct seg *segs;
+	uint32_t n_segs;
+	struct table node_table, seg_table;
+	uint32_t *node_match;	/* in the other map, NONE if none */
+	uint32_t *seg_match;
+} maps[2];
+
+static uint32_t next_job_nr;
+
+
+static void *grow(void *p, uint32_t *size, size_t elem)
+{
+	*size = *size ? 2**size : 1024;
+	p = realloc(p, elem**size);
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+
+/* ----- Parsing ----------------------------------------------------------- */
+
+
+static bool get_int(const char **p, const char *end, int *res)
+{
+	const char *s = *p;
+	bool neg = 0;
+	int v = 0;
+
+	while (s != end && *s == ' ')
+		s++;
+	if (s != end && *s == '-') {
+		neg = 1;
+		s++;
+	}
+	if (s == end || *s < '0' || *s > '9')
+		return 0;
+	while (s != end && *s >= '0' && *s <= '9')
+		v = v*10+*s++-'0';
+	*res = neg ? -v : v;
+	*p = s;
+	return 1;
+}
+
+
+/* "x y d # id" */
+
+static bool get_point(const char *s, const char *end, struct node *n)
+{
+	if (!get_int(&s, end, &n->x) || !get_int(&s, end, &n->y) ||
+	    !get_int(&s, end, &n->d))
+		return 0;
+	while (s != end && *s == ' ')
+		s++;
+	if (s == end || *s++ != '#')
+		return 0;
+	return get_int(&s, end, &n->id);
+}
+
+
+static void add_node(struct chunk *c, const struct node *n)
+{
+	if (c->n_nodes == c->nodes_size)
+		c->nodes = grow(c->nodes, &c->nodes_size, sizeof(struct node));
+	c->nodes[c->n_nodes++] = *n;
+}
+
+
+static void add_seg(struct chunk *c, const struct node *a,
+    const struct node *b)
+{
+	struct seg *s;
+
+	if (c->n_segs == c->segs_size)
+		c->segs = grow(c->segs, &c->segs_size, sizeof(struct seg));
+	s = c->segs+c->n_segs++;
+	s->a = a->id;
+	s->b = b->id;
+	s->ax = a->x;
+	s->ay = a->y;
+	s->bx = b->x;
+	s->by = b->y;
+	s->d = a->d;
+}
+
+
+/* "id x y d" */
+
+static bool get_entry(const char *s, const char *end, struct node *n)
+{
+	if (!get_int(&s, end, &n->id) || !get_int(&s, end, &n->x) ||
+	    !get_int(&s, end, &n->y) || !get_int(&s, end, &n->d))
+		return 0;
+	while (s != end && *s == ' ')
+		s++;
+	return s == end;
+}
+
+
+static void parse_table_chunk(const struct input *in, struct chunk *c)
+{
+	const char *s = c->from, *end;
+	struct node n;
+
+	while (s != c->to) {
+		end = memchr(s, '\n', c->to-s);
+		if (!end)
+			end = c->to;
+		if (end != s && *s != '#') {
+			if (!get_entry(s, end, &n)) {
+				fprintf(stderr, "%s: bad line \"%.*s\"\n",
+				    in->name, (int) (end-s), s);
+				exit(1);
+			}
+			add_node(c, &n);
+		}
+		s = end == c->to ? end : end+1;
+	}
+}
+
+
+static void parse_chunk(const struct input *in, struct chunk *c)
+{
+	const char *s = c->from, *end;
+	struct node first, n;
+	bool pending = 0;
+
+	while (s != c->to) {
+		end = memchr(s, '\n', c->to-s);
+		if (!end)
+			end = c->to;
+		if (end == s) {
+			pending = 0;
+		} else if (*s == '#') {
+			if (end-s > 8 && !strncmp(s, "#STATION", 8)) {
+				if (!get_point(s+8, end, &n))
+					goto fail;
+				if (in->want_nodes)
+					add_node(c, &n);
+			}
+		} else {
+			if (!get_point(s, end, &n))
+				goto fail;
+			if (pending) {
+				add_seg(c, &first, &n);
+				pending = 0;
+			} else {
+				if (in->want_nodes)
+					add_node(c, &n);
+				first = n;
+				pending = 1;
+			}
+		}
+		s = end == c->to ? end : end+1;
+	}
+	return;
+
+fail:
+	fprintf(stderr, "%s: bad line \"%.*s\"\n", in->name, (int) (end-s), s);
+	exit(1);
+}
+
+
+static void parse_chunks(void *user, unsigned thread)
+{
+	struct input *in = user;
+	uint32_t i;
+
+	while (1) {
+		i = next_job(&next_job_nr);
+		if (i >= in->n_chunks)
+			break;
+		if (in->node_table)
+			parse_table_chunk(in, in->chunks+i);
+		else
+			parse_chunk(in, in->chunks+i);
+	}
+}
+
+
+/*
+ * Map chunks end after an empty line, so that no segment is split, and
+ * node table chunks after any line.
+ */
+
+static const char *chunk_end(const struct input *in, size_t pos)
+{
+	const char *p = in->base+pos;
+	const char *end = in->base+in->size;
+
+	if (pos >= in->size)
+		return end;
+	while (1) {
+		p = memchr(p, '\n', end-p);
+		if (!p || p+1 == end)
+			return end;
+		if (in->node_table)
+			return p+1;
+		if (p[1] == '\n')
+			return p+2;
+		p++;
+	}
+}
+
+
+static void read_file(struct input *in)
+{
+	struct chunk *c;
+	struct stat st;
+	const char *p;
+	int fd;
+
+	fd = open(in->name, O_RDONLY);
+	if (fd < 0) {
+		perror(in->name);
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		exit(1);
+	}
+	in->size = st.st_size;
+	in->base = in->size ?
+	    mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+	if (in->base == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+
+	in->chunks = calloc(in->size/CHUNK+1, sizeof(struct chunk));
+	if (!in->chunks) {
+		perror("calloc");
+		exit(1);
+	}
+	for (p = in->base; p != in->base+in->size; in->n_chunks++) {
+		c = in->chunks+in->n_chunks;
+		c->from = p;
+		c->to = p = chunk_end(in, p-in->base+CHUNK);
+	}
+	next_job_nr = 0;
+	parallel(parse_chunks, in);
+}
+
+
+/* append the nodes and segments of the chunks, in order */
+
+static void collect(struct map *m, struct input *in)
+{
+	struct chunk *c;
+	uint32_t nodes = m->n_nodes, segs = m->n_segs;
+
+	for (c = in->chunks; c != in->chunks+in->n_chunks; c++) {
+		nodes += c->n_nodes;
+		segs += c->n_segs;
+	}
+	m->nodes = realloc(m->nodes, sizeof(struct node)*nodes);
+	m->segs = realloc(m->segs, sizeof(struct seg)*segs);
+	if ((nodes && !m->nodes) || (segs && !m->segs)) {
+		perror("realloc");
+		exit(1);
+	}
+	for (c = in->chunks; c != in->chunks+in->n_chunks; c++) {
+		memcpy(m->nodes+m->n_nodes, c->nodes,
+		    sizeof(struct node)*c->n_nodes);
+		memcpy(m->segs+m->n_segs, c->segs,
+		    sizeof(struct seg)*c->n_segs);
+		m->n_nodes += c->n_nodes;
+		m->n_segs += c->n_segs;
+		free(c->nodes);
+		free(c->segs);
+	}
+	free(in->chunks);
+	if (in->size)
+		munmap((void *) in->base, in->size);
+}
+
+
+static void read_map(struct map *m)
+{
+	struct input in;
+
+	memset(&in, 0, sizeof(in));
+	in.name = m->name;
+	in.want_nodes = !m->node_file;	/* else, they come from the table */
+	read_file(&in);
+	collect(m, &in);
+	if (m->node_file) {
+		memset(&in, 0, sizeof(in));
+		in.name = m->node_file;
+		in.node_table = 1;
+		read_file(&in);
+		collect(m, &in);
+	}
+}
+
+
+/* ----- Hash join --------------------------------------------------------- */
+
+
+static uint64_t node_key(const struct node *n)
+{
+	return (uint64_t) 1 << 32 | (uint32_t) n->id;
+}
+
+
+static uint64_t seg_key(const struct seg *s)
+{
+	return (uint64_t) (uint32_t) s->a << 32 | (uint32_t) s->b;
+}
+
+
+static uint64_t hash(uint64_t key)
+{
+	key *= 0x9e3779b97f4a7c15ull;
+	return key ^ key >> 29;
+}
+
+
+static void init_table(struct table *t, uint32_t n)
+{
+	uint64_t size = 1024, i;
+
+	while (size < 2*(uint64_t) n)
+		size <<= 1;
+	t->keys = calloc(size, sizeof(uint64_t));
+	t->vals = alloc_array(size, sizeof(uint32_t));
+	if (!t->keys) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i != size; i++)
+		t->vals[i] = NONE;
+	t->mask = size-1;
+}
+
+
+static void atomic_min(uint32_t *p, uint32_t v)
+{
+	uint32_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	while (v < old)
+		if (__atomic_compare_exchange_n(p, &old, v, 0,
+		    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+}
+
+
+static void insert(struct table *t, uint64_t key, uint32_t val)
+{
+	uint64_t i = hash(key) & t->mask;
+	uint64_t old;
+
+	while (1) {
+		old = 0;
+		if (__atomic_compare_exchange_n(t->keys+i, &old, key, 0,
+		    __ATOMIC_RELAXED, __ATOMIC_RELAXED) || old == key) {
+			atomic_min(t->vals+i, val);
+			return;
+		}
+		i = (i+1) & t->mask;
+	}
+}
+
+
+static uint32_t lookup(const struct table *t, uint64_t key)
+{
+	uint64_t i = hash(key) & t->mask;
+
+	while (t->keys[i]) {
+		if (t->keys[i] == key)
+			return t->vals[i];
+		i = (i+1) & t->mask;
+	}
+	return NONE;
+}
+
+
+static bool next_block(uint32_t n, uint32_t *from, uint32_t *to)
+{
+	uint32_t block = next_job(&next_job_nr);
+
+	if ((uint64_t) block*BLOCK >= n)
+		return 0;
+	*from = block*BLOCK;
+	*to = n-*from < BLOCK ? n : *from+BLOCK;
+	return 1;
+}
+
+
+static void build_nodes(void *user, unsigned thread)
+{
+	struct map *m = user;
+	uint32_t from, to, i;
+
+	while (next_block(m->n_nodes, &from, &to))
+		for (i = from; i != to; i++)
+			insert(&m->node_table, node_key(m->nodes+i), i);
+}
+
+
+static void build_segs(void *user, unsigned thread)
+{
+	struct map *m = user;
+	uint32_t from, to, i;
+
+	while (next_block(m->n_segs, &from, &to))
+		for (i = from; i != to; i++)
+			insert(&m->seg_table, seg_key(m->segs+i), i);
+}
+
+
+static void probe_nodes(void *user, unsigned thread)
+{
+	struct map *m = user;
+	const struct map *other = m == maps ? maps+1 : maps;
+	uint32_t from, to, i;
+
+	while (next_block(m->n_nodes, &from, &to))
+		for (i = from; i != to; i++)
+			m->node_match[i] = lookup(&other->node_table,
+			    node_key(m->nodes+i));
+}
+
+
+static void probe_segs(void *user, unsigned thread)
+{
+	struct map *m = user;
+	const struct map *other = m == maps ? maps+1 : maps;
+	uint32_t from, to, i;
+
+	while (next_block(m->n_segs, &from, &to))
+		for (i = from; i != to; i++)
+			m->seg_match[i] = lookup(&other->seg_table,
+			    seg_key(m->segs+i));
+}
+
+
+static void run(void (*fn)(void *user, unsigned thread), struct map *m)
+{
+	next_job_nr = 0;
+	parallel(fn, m);
+}
+
+
+static void join(void)
+{
+	struct map *m;
+
+	for (m = maps; m != maps+2; m++) {
+		init_table(&m->node_table, m->n_nodes);
+		init_table(&m->seg_table, m->n_segs);
+		run(build_nodes, m);
+		run(build_segs, m);
+	}
+	for (m = maps; m != maps+2; m++) {
+		m->node_match = alloc_array(m->n_nodes, sizeof(uint32_t));
+		m->seg_match = alloc_array(m->n_segs, sizeof(uint32_t));
+		run(probe_nodes, m);
+		run(probe_segs, m);
+	}
+}
+
+
+/* ----- Output ------------------------------------------------------------ */
+
+
+/* whether this is the first appearance of the node or segment */
+
+static bool first_node(const struct map *m, uint32_t i)
+{
+	return lookup(&m->node_table, node_key(m->nodes+i)) == i;
+}
+
+
+static bool first_seg(const struct map *m, uint32_t i)
+{
+	return lookup(&m->seg_table, seg_key(m->segs+i)) == i;
+}
+
+
+static double seg_length(const struct seg *s)
+{
+	return hypot(s->bx-s->ax, s->by-s->ay);
+}
+
+
+/* the segments of the new map, with the change of distance */
+
+static void write_delta_map(FILE *file)
+{
+	const struct map *old = maps, *new = maps+1;
+	const struct seg *s;
+	uint32_t i;
+	int delta;
+
+	for (i = 0; i != new->n_segs; i++) {
+		if (new->seg_match[i] == NONE || !first_seg(new, i))
+			continue;
+		s = new->segs+i;
+		delta = s->d-old->segs[new->seg_match[i]].d;
+		fprintf(file, "%d %d %d # %d\n%d %d %d # %d\n\n",
+		    s->ax, s->ay, delta, s->a, s->bx, s->by, delta, s->b);
+	}
+}
+
+
+static void write_nodes(FILE *file)
+{
+	const struct map *old = maps, *new = maps+1;
+	const struct node *n;
+	uint32_t i;
+
+	fprintf(file, "# id x y old(m) new(m) change(m)\n");
+	for (i = 0; i != new->n_nodes; i++) {
+		if (new->node_match[i] == NONE || !first_node(new, i))
+			continue;
+		n = new->nodes+i;
+		fprintf(file, "%d %d %d %d %d %d\n", n->id, n->x, n->y,
+		    old->nodes[new->node_match[i]].d, n->d,
+		    n->d-old->nodes[new->node_match[i]].d);
+	}
+}
+
+
+static void write_report(FILE *file)
+{
+	static const char *name[bands] =
+	    { "good", "average", "bad", "remote" };
+	const struct map *old = maps, *new = maps+1;
+	double length[bands][bands] = { { 0 } };
+	double only_old = 0, only_new = 0;
+	unsigned both = 0, closer = 0, farther = 0;
+	unsigned n_old = 0, n_new = 0;
+	int64_t sum = 0;
+	uint32_t i;
+	int delta;
+	enum band a, b;
+
+	for (i = 0; i != new->n_nodes; i++) {
+		if (!first_node(new, i))
+			continue;
+		if (new->node_match[i] == NONE) {
+			n_new++;
+			continue;
+		}
+		delta = new->nodes[i].d-old->nodes[new->node_match[i]].d;
+		both++;
+		sum += delta;
+		closer += delta < 0;
+		farther += delta > 0;
+	}
+	for (i = 0; i != old->n_nodes; i++)
+		if (first_node(old, i) && old->node_match[i] == NONE)
+			n_old++;
+
+	for (i = 0; i != new->n_segs; i++) {
+		if (!first_seg(new, i))
+			continue;
+		if (new->seg_match[i] == NONE) {
+			only_new += seg_length(new->segs+i);
+			continue;
+		}
+		a = classify(old->segs[new->seg_match[i]].d);
+		b = classify(new->segs[i].d);
+		length[a][b] += seg_length(new->segs+i);
+	}
+	for (i = 0; i != old->n_segs; i++)
+		if (first_seg(old, i) && old->seg_match[i] == NONE)
+			only_old += seg_length(old->segs+i);
+
+	fprintf(file, "# nodes: %u in both, %u only old, %u only new\n",
+	    both, n_old, n_new);
+	fprintf(file, "# %u closer, %u farther, %u unchanged, "
+	    "mean change %.1f m\n", closer, farther, both-closer-farther,
+	    both ? (double) sum/both : 0);
+	fprintf(file, "# road only old %.0f m, only new %.0f m\n",
+	    only_old, only_new);
+	fprintf(file, "# road length (m) by old band (rows) and new band\n");
+	fprintf(file, "# old good average bad remote\n");
+	for (a = 0; a != bands; a++)
+		fprintf(file, "%s %.0f %.0f %.0f %.0f\n", name[a],
+		    length[a][band_good], length[a][band_average],
+		    length[a][band_bad], length[a][band_remote]);
+}
+
+
+/* ----- Main -------------------------------------------------------------- */
+
+
+static FILE *open_output(const char *name)
+{
+	FILE *file;
+
+	file = fopen(name, "w");
+	if (!file) {
+		perror(name);
+		exit(1);
+	}
+	return file;
+}
+
+
+static void close_output(FILE *file, const char *name)
+{
+	if (fclose(file) < 0) {
+		perror(name);
+		exit(1);
+	}
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+"usage: %s [-d old,new] [-j threads] [-n file] [-s report]\n"
+"       %*s old.gp new.gp\n\n"
+"  -d old,new  compare the distances of all nodes, from the node tables\n"
+"              subosm -d wrote with the old and the new map\n"
+"  -j threads  threads to use (default: 0, one per CPU)\n"
+"  -n file     write the distance of each node in both maps, and its change\n"
+"  -s report   write the changes between the distance bands to \"report\"\n"
+"              instead of stderr\n\n"
+"The segments in both maps are written to stdout, in the format of subosm,\n"
+"with the change of distance (m) instead of the distance.\n"
+	    , name, (int) strlen(name), "");
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	const char *nodes = NULL;
+	const char *report = NULL;
+	FILE *file;
+	char *end;
+	int c;
+
+	set_threads(0);
+	while ((c = getopt(argc, argv, "d:j:n:s:")) != EOF)
+		switch (c) {
+		case 'd':
+			end = strchr(optarg, ',');
+			if (!end || end == optarg || !end[1])
+				usage(*argv);
+			maps[0].node_file = strndup(optarg, end-optarg);
+			if (!maps[0].node_file) {
+				perror("strndup");
+				exit(1);
+			}
+			maps[1].node_file = end+1;
+			break;
+		case 'j':
+			set_threads(strtoul(optarg, &end, 0));
+			if (*end)
+				usage(*argv);
+			break;
+		case 'n':
+			nodes = optarg;
+			break;
+		case 's':
+			report = optarg;
+			break;
+		default:
+			usage(*argv);
+		}
+	if (argc-optind != 2)
+		usage(*argv);
+
+	maps[0].name = argv[optind];
+	maps[1].name = argv[optind+1];
+	read_map(maps);
+	read_map(maps+1);
+	join();
+
+	write_delta_map(stdout);
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		perror("stdout");
+		exit(1);
+	}
+	if (nodes) {
+		file = open_output(nodes);
+		write_nodes(file);
+		close_output(file, nodes);
+	}
+	if (report) {
+		file = open_output(report);
+		write_report(file);
+		close_output(file, report);
+	} else {
+		write_report(stderr);
+	}
+	return 0;
+}
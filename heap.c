@@ -0,0 +1,74 @@
+/*
+ * heap.c - Binary min-heap for label-setting searches
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "heap.h"
+
+
+void heap_init(struct heap *h)
+{
+	h->e = NULL;
+	h->n = h->size = 0;
+}
+
+
+void heap_push(struct heap *h, uint64_t key, uint32_t val)
+{
+	struct heap_entry *e;
+	uint32_t i, parent;
+
+	if (h->n == h->size) {
+		h->size = h->size ? 2*h->size : 1024;
+		h->e = realloc(h->e, sizeof(struct heap_entry)*h->size);
+		if (!h->e) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	e = h->e;
+	for (i = h->n++; i; i = parent) {
+		parent = (i-1)/2;
+		if (e[parent].key <= key)
+			break;
+		e[i] = e[parent];
+	}
+	e[i].key = key;
+	e[i].val = val;
+}
+
+
+struct heap_entry heap_pop(struct heap *h)
+{
+	struct heap_entry *e = h->e;
+	struct heap_entry top = e[0], last = e[--h->n];
+	uint32_t i = 0, child;
+
+	while (1) {
+		child = 2*i+1;
+		if (child >= h->n)
+			break;
+		if (child+1 < h->n && e[child+1].key < e[child].key)
+			child++;
+		if (last.key <= e[child].key)
+			break;
+		e[i] = e[child];
+		i = child;
+	}
+	e[i] = last;
+	return top;
+}
+
+
+void heap_free(struct heap *h)
+{
+	free(h->e);
+	heap_init(h);
+}
@@ -0,0 +1,41 @@
+/*
+ * heap.h - Binary min-heap for label-setting searches
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef HEAP_H
+#define	HEAP_H
+
+#include <stdint.h>
+
+
+/*
+ * Entries are ordered by "key" alone. Searches push a node again when they
+ * improve its label, and skip the stale entries when they pop them.
+ */
+
+struct heap_entry {
+	uint64_t key;
+	uint32_t val;
+};
+
+struct heap {
+	struct heap_entry *e;
+	uint32_t n, size;
+};
+
+
+void heap_init(struct heap *h);
+void heap_push(struct heap *h, uint64_t key, uint32_t val);
+
+/* the heap must not be empty */
+
+struct heap_entry heap_pop(struct heap *h);
+
+void heap_free(struct heap *h);
+
+#endif /* HEAP_H */
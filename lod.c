@@ -0,0 +1,218 @@
+/*
+ * lod.c - Simplified output geometry
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "db.h"
+#include "route.h"
+#include "stats.h"
+#include "lod.h"
+
+
+static uint8_t *visited;	/* per edge, both directions */
+
+static uint32_t *path;		/* nodes of the current chain */
+static uint8_t *keep;		/* keep this node in the output */
+static unsigned *todo;		/* stack of spans to simplify */
+static unsigned n_path, path_size;
+
+
+/* ----- Chains ------------------------------------------------------------ */
+
+
+static uint32_t reverse_edge(unsigned from, uint32_t e)
+{
+	unsigned to = edge_to[e];
+	uint32_t r;
+
+	for (r = edge_first[to]; r != edge_first[to+1]; r++)
+		if (edge_to[r] == from)
+			return r;
+	abort();	/* edges always come in pairs */
+}
+
+
+static void add_to_path(unsigned n)
+{
+	if (n_path == path_size) {
+		path_size = path_size ? 2*path_size : 1024;
+		path = realloc(path, sizeof(uint32_t)*path_size);
+		keep = realloc(keep, path_size);
+		todo = realloc(todo, 2*sizeof(unsigned)*path_size);
+		if (!path || !keep || !todo) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	keep[n_path] = 0;
+	path[n_path++] = n;
+}
+
+
+/*
+ * Follow edge "e" from node "n" through shape points, until we reach a node
+ * that isn't a shape point, or come back to where a closed loop started.
+ */
+
+static void walk(unsigned n, uint32_t e)
+{
+	n_path = 0;
+	add_to_path(n);
+	while (1) {
+		visited[e] = visited[reverse_edge(n, e)] = 1;
+		n = edge_to[e];
+		add_to_path(n);
+		if (!shape_point(n))
+			break;
+		e = edge_first[n];
+		if (visited[e])
+			e++;
+		if (visited[e])
+			break;
+	}
+}
+
+
+/* ----- Douglas-Peucker --------------------------------------------------- */
+
+
+static double offset(unsigned p, unsigned a, unsigned b)
+{
+	double dx = node_x[b]-node_x[a];
+	double dy = node_y[b]-node_y[a];
+	double px = node_x[p]-node_x[a];
+	double py = node_y[p]-node_y[a];
+	double len2 = dx*dx+dy*dy;
+	double t;
+
+	if (!len2)
+		return hypot(px, py);
+	t = (px*dx+py*dy)/len2;
+	if (t < 0)
+		t = 0;
+	if (t > 1)
+		t = 1;
+	return hypot(px-t*dx, py-t*dy);
+}
+
+
+static void simplify(unsigned a, unsigned b, double tolerance)
+{
+	unsigned sp = 0;
+	unsigned i, worst;
+	double d, max;
+
+	todo[sp++] = a;
+	todo[sp++] = b;
+	while (sp) {
+		b = todo[--sp];
+		a = todo[--sp];
+		max = -1;
+		worst = a;
+		for (i = a+1; i < b; i++) {
+			d = offset(path[i], path[a], path[b]);
+			if (d > max) {
+				max = d;
+				worst = i;
+			}
+		}
+		if (max <= tolerance)
+			continue;
+		keep[worst] = 1;
+		todo[sp++] = a;
+		todo[sp++] = worst;
+		todo[sp++] = worst;
+		todo[sp++] = b;
+	}
+}
+
+
+/* ----- Output ------------------------------------------------------------ */
+
+
+/*
+ * Nodes where the distance band changes are always kept, so we only ever
+ * simplify runs of nodes that are all in the same band.
+ */
+
+static void dump_path(FILE *file, double tolerance)
+{
+	unsigned i, last;
+	unsigned a, b;
+
+	keep[0] = keep[n_path-1] = 1;
+	for (i = 1; i != n_path; i++)
+		if (classify(node_distance[path[i]]) !=
+		    classify(node_distance[path[i-1]]))
+			keep[i-1] = keep[i] = 1;
+
+	last = 0;
+	for (i = 1; i != n_path; i++)
+		if (keep[i]) {
+			if (i > last+1)
+				simplify(last, i, tolerance);
+			last = i;
+		}
+
+	last = 0;
+	for (i = 1; i != n_path; i++) {
+		if (!keep[i])
+			continue;
+		a = path[last];
+		b = path[i];
+		fprintf(file, "%d %d %d # %d\n%d %d %d # %d\n\n",
+		    node_x[a], node_y[a], node_distance[a], node_id[a],
+		    node_x[b], node_y[b], node_distance[a], node_id[b]);
+		last = i;
+	}
+}
+
+
+void dump_lod(FILE *file, double tolerance)
+{
+	unsigned n;
+	uint32_t e;
+
+	visited = calloc(n_edges, 1);
+	if (n_edges && !visited) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (n = 0; n != n_nodes; n++)
+		if (eligible(n))
+			fprintf(file, "#STATION %d %d %d # %d\n",
+			    node_x[n], node_y[n], node_distance[n], node_id[n]);
+
+	for (n = 0; n != n_nodes; n++) {
+		if (shape_point(n))
+			continue;
+		for (e = edge_first[n]; e != edge_first[n+1]; e++)
+			if (!visited[e]) {
+				walk(n, e);
+				dump_path(file, tolerance);
+			}
+	}
+
+	/* what's left are closed loops without junctions */
+	for (n = 0; n != n_nodes; n++)
+		for (e = edge_first[n]; e != edge_first[n+1]; e++)
+			if (!visited[e]) {
+				walk(n, e);
+				dump_path(file, tolerance);
+			}
+
+	free(visited);
+}
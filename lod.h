@@ -0,0 +1,24 @@
+/*
+ * lod.h - Simplified output geometry
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef LOD_H
+#define	LOD_H
+
+#include <stdio.h>
+
+
+/*
+ * Write the network like dump_db, but with each chain between junctions
+ * simplified such that no node is farther than "tolerance" meters from the
+ * output. Segments never span more than one distance band.
+ */
+
+void dump_lod(FILE *file, double tolerance);
+
+#endif /* LOD_H */
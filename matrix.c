@@ -0,0 +1,336 @@
+/*
+ * matrix.c - Walking distances between stations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * We search outwards from each station, but only up to half the cutoff. Any
+ * path of at most "cutoff" meters between two stations then has a node that
+ * the search of one station has reached and that the search of the other
+ * station has settled. Each node keeps a "bucket" of the stations that
+ * settled it, and the distance between two stations is the minimum over all
+ * the nodes they meet at.
+ *
+ * More precisely, let v be the last node on the path that is within half
+ * the cutoff of the first station, and w the node after it. The first
+ * search settles v and thus labels w. The rest of the path after w is
+ * shorter than half the cutoff, so the second search settles w. If v is the
+ * last node on the path, both searches settle it, since we require seeds to
+ * be within half the cutoff.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "util.h"
+#include "heap.h"
+#include "db.h"
+#include "route.h"
+#include "parallel.h"
+#include "matrix.h"
+
+
+#define	INF	UINT16_MAX
+
+
+static unsigned cutoff, radius;
+
+static uint32_t *stations;	/* station -> node */
+static uint32_t n_stations;
+
+/*
+ * What the search of a station reached: the nodes it settled (distance up to
+ * "radius"), followed by the nodes it only labelled.
+ */
+
+static struct ball {
+	uint32_t *node;
+	uint16_t *d;
+	uint32_t settled, n;
+} *balls;
+
+/* the stations that settled each node, as CSR */
+
+static uint32_t *b_first;
+static uint32_t *b_station;
+static uint16_t *b_d;
+
+/* the result, one sparse row per station */
+
+static struct row {
+	uint32_t *to;
+	uint16_t *d;
+	uint32_t n;
+} *rows;
+
+static uint32_t next_station;
+
+
+/* ----- Bounded search ---------------------------------------------------- */
+
+
+struct worker {
+	uint16_t *dist;		/* per node, INF if not reached */
+	uint32_t *touched;	/* nodes with a distance */
+	uint32_t n_touched;
+	struct heap heap;	/* key: distance, val: node */
+};
+
+
+static void label(struct worker *w, unsigned n, unsigned d)
+{
+	if (d > cutoff || d >= w->dist[n])
+		return;
+	if (w->dist[n] == INF)
+		w->touched[w->n_touched++] = n;
+	w->dist[n] = d;
+	heap_push(&w->heap, d, n);
+}
+
+
+static void search(struct worker *w, unsigned s)
+{
+	unsigned station = stations[s];
+	struct ball *b = balls+s;
+	struct heap_entry top;
+	unsigned m, i, j;
+	uint32_t e;
+	int d;
+
+	w->n_touched = 0;
+	for (m = 0; m != n_nodes; m++) {
+		if (edge_first[m] == edge_first[m+1])
+			continue;
+		d = hypot(node_x[station]-node_x[m],
+		    node_y[station]-node_y[m]);
+		if (d <= NEAR)
+			label(w, m, d);
+	}
+
+	while (w->heap.n) {
+		top = heap_pop(&w->heap);
+		if (top.key > radius)
+			break;
+		if (top.key != w->dist[top.val])
+			continue;	/* stale entry */
+		for (e = edge_first[top.val]; e != edge_first[top.val+1];
+		    e++)
+			label(w, edge_to[e], top.key+edge_len[e]);
+	}
+	w->heap.n = 0;
+
+	/*
+	 * Everything up to "radius" has been popped, so what's left are the
+	 * labelled nodes.
+	 */
+	b->n = w->n_touched;
+	b->node = alloc_array(b->n, sizeof(uint32_t));
+	b->d = alloc_array(b->n, sizeof(uint16_t));
+	i = 0;
+	j = b->n;
+	for (m = 0; m != w->n_touched; m++) {
+		d = w->dist[w->touched[m]];
+		if (d <= radius) {
+			b->node[i] = w->touched[m];
+			b->d[i++] = d;
+		} else {
+			b->node[--j] = w->touched[m];
+			b->d[j] = d;
+		}
+		w->dist[w->touched[m]] = INF;
+	}
+	b->settled = i;
+}
+
+
+static void init_worker(struct worker *w)
+{
+	unsigned n;
+
+	w->dist = alloc_array(n_nodes, sizeof(uint16_t));
+	for (n = 0; n != n_nodes; n++)
+		w->dist[n] = INF;
+	w->touched = alloc_array(n_nodes, sizeof(uint32_t));
+	heap_init(&w->heap);
+}
+
+
+static void search_stations(void *user, unsigned thread)
+{
+	struct worker w;
+	uint32_t s;
+
+	init_worker(&w);
+	while (1) {
+		s = next_job(&next_station);
+		if (s >= n_stations)
+			break;
+		search(&w, s);
+	}
+	free(w.dist);
+	free(w.touched);
+	heap_free(&w.heap);
+}
+
+
+/* ----- Buckets ----------------------------------------------------------- */
+
+
+/*
+ * We fill the buckets in station order, so each bucket is sorted by
+ * station.
+ */
+
+static void make_buckets(void)
+{
+	const struct ball *b;
+	uint32_t *next;
+	unsigned n, s, i;
+
+	b_first = calloc(n_nodes+1, sizeof(uint32_t));
+	if (!b_first) {
+		perror("calloc");
+		exit(1);
+	}
+	for (b = balls; b != balls+n_stations; b++)
+		for (i = 0; i != b->settled; i++)
+			b_first[b->node[i]+1]++;
+	for (n = 0; n != n_nodes; n++)
+		b_first[n+1] += b_first[n];
+
+	b_station = alloc_array(b_first[n_nodes], sizeof(uint32_t));
+	b_d = alloc_array(b_first[n_nodes], sizeof(uint16_t));
+	next = alloc_array(n_nodes, sizeof(uint32_t));
+	for (n = 0; n != n_nodes; n++)
+		next[n] = b_first[n];
+	for (s = 0; s != n_stations; s++) {
+		b = balls+s;
+		for (i = 0; i != b->settled; i++) {
+			n = b->node[i];
+			b_station[next[n]] = s;
+			b_d[next[n]++] = b->d[i];
+		}
+	}
+	free(next);
+}
+
+
+/* ----- Rows -------------------------------------------------------------- */
+
+
+static int comp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static void make_row(unsigned s, uint16_t *best, uint32_t *to)
+{
+	const struct ball *b = balls+s;
+	struct row *r = rows+s;
+	unsigned i, n, t, d;
+	uint32_t k;
+
+	r->n = 0;
+	for (i = 0; i != b->n; i++) {
+		n = b->node[i];
+		for (k = b_first[n]; k != b_first[n+1]; k++) {
+			t = b_station[k];
+			d = b->d[i]+b_d[k];
+			if (t == s || d > cutoff || d >= best[t])
+				continue;
+			if (best[t] == INF)
+				to[r->n++] = t;
+			best[t] = d;
+		}
+	}
+	qsort(to, r->n, sizeof(uint32_t), comp_u32);
+
+	r->to = alloc_array(r->n, sizeof(uint32_t));
+	r->d = alloc_array(r->n, sizeof(uint16_t));
+	for (i = 0; i != r->n; i++) {
+		r->to[i] = to[i];
+		r->d[i] = best[to[i]];
+		best[to[i]] = INF;
+	}
+}
+
+
+static void make_rows(void *user, unsigned thread)
+{
+	uint16_t *best;
+	uint32_t *to;
+	uint32_t s;
+
+	best = alloc_array(n_stations, sizeof(uint16_t));
+	to = alloc_array(n_stations, sizeof(uint32_t));
+	for (s = 0; s != n_stations; s++)
+		best[s] = INF;
+	while (1) {
+		s = next_job(&next_station);
+		if (s >= n_stations)
+			break;
+		make_row(s, best, to);
+	}
+	free(best);
+	free(to);
+}
+
+
+/* ----- Output ------------------------------------------------------------ */
+
+
+void write_matrix(FILE *file, unsigned max)
+{
+	unsigned s, i;
+	unsigned long pairs = 0;
+
+	cutoff = max;
+	radius = cutoff/2;
+	if (radius < NEAR) {
+		fprintf(stderr, "cutoff must be at least %u m\n", 2*NEAR);
+		exit(1);
+	}
+
+	n_stations = count_routes();
+	stations = station_nodes();
+
+	balls = alloc_array(n_stations, sizeof(struct ball));
+	next_station = 0;
+	parallel(search_stations, NULL);
+	make_buckets();
+
+	rows = alloc_array(n_stations, sizeof(struct row));
+	next_station = 0;
+	parallel(make_rows, NULL);
+
+	fprintf(file, "# from to distance(m)\n");
+	for (s = 0; s != n_stations; s++) {
+		for (i = 0; i != rows[s].n; i++)
+			fprintf(file, "%d %d %u\n", node_id[stations[s]],
+			    node_id[stations[rows[s].to[i]]], rows[s].d[i]);
+		pairs += rows[s].n;
+		free(rows[s].to);
+		free(rows[s].d);
+		free(balls[s].node);
+		free(balls[s].d);
+	}
+	fprintf(stderr, "%lu station pairs within %u m\n", pairs, cutoff);
+
+	free(rows);
+	free(balls);
+	free(b_first);
+	free(b_station);
+	free(b_d);
+	free(stations);
+}
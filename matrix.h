@@ -0,0 +1,27 @@
+/*
+ * matrix.h - Walking distances between stations
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MATRIX_H
+#define	MATRIX_H
+
+#include <stdio.h>
+
+
+#define	MAX_CUTOFF	60000	/* distances are 16 bits */
+
+
+/*
+ * Write the walking distance between all pairs of stations that are at most
+ * "cutoff" meters apart, as lines of "from to distance", with station node
+ * IDs. The cutoff must be at least 2*NEAR.
+ */
+
+void write_matrix(FILE *file, unsigned cutoff);
+
+#endif /* MATRIX_H */
@@ -0,0 +1,79 @@
+/*
+ * parallel.c - Run work in several threads
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "parallel.h"
+
+
+unsigned threads = 1;
+
+
+struct job {
+	pthread_t thread;
+	void (*fn)(void *user, unsigned thread);
+	void *user;
+	unsigned n;
+};
+
+
+void set_threads(unsigned n)
+{
+	long cpus;
+
+	if (!n) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = cpus > 0 ? cpus : 1;
+	}
+	threads = n;
+}
+
+
+static void *run(void *arg)
+{
+	const struct job *job = arg;
+
+	job->fn(job->user, job->n);
+	return NULL;
+}
+
+
+void parallel(void (*fn)(void *user, unsigned thread), void *user)
+{
+	struct job *jobs;
+	unsigned i;
+	int err;
+
+	jobs = calloc(threads, sizeof(struct job));
+	if (!jobs) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i != threads; i++) {
+		jobs[i].fn = fn;
+		jobs[i].user = user;
+		jobs[i].n = i;
+	}
+	for (i = 1; i != threads; i++) {
+		err = pthread_create(&jobs[i].thread, NULL, run, jobs+i);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	fn(user, 0);
+	for (i = 1; i != threads; i++)
+		pthread_join(jobs[i].thread, NULL);
+	free(jobs);
+}
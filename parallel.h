@@ -0,0 +1,38 @@
+/*
+ * parallel.h - Run work in several threads
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef PARALLEL_H
+#define	PARALLEL_H
+
+#include <stdint.h>
+
+
+extern unsigned threads;
+
+
+/* set the number of threads, 0 for one per CPU */
+
+void set_threads(unsigned n);
+
+
+/*
+ * Call fn in "threads" threads, and wait until all of them have returned.
+ * The calling thread runs as thread 0.
+ */
+
+void parallel(void (*fn)(void *user, unsigned thread), void *user);
+
+/* hand out the numbers 0 ... n-1, one at a time */
+
+static inline uint32_t next_job(uint32_t *counter)
+{
+	return __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+#endif /* PARALLEL_H */
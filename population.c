@@ -0,0 +1,573 @@
+/*
+ * population.c - Coverage by population
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Population points are joined to the nearest road segment through a grid of
+ * buckets, each listing the segments whose bounding box touches it. A search
+ * looks at the buckets in rings around the point, and can stop once the
+ * nearest segment so far is closer than anything in the next ring could be.
+ * The distance of the point is that of the place where it projects onto the
+ * segment, coming from whichever end is better.
+ *
+ * Points are joined in parallel, in blocks, and the results are summed up in
+ * the order of the points, so that they don't depend on the threads.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "util.h"
+#include "local.h"
+#include "clip.h"
+#include "db.h"
+#include "route.h"
+#include "stats.h"
+#include "parallel.h"
+#include "population.h"
+
+
+#define	BUCKET		100	/* bucket size (m) */
+#define	BLOCK		4096	/* points per job */
+#define	MAX_LINE	200
+
+
+static struct point {
+	int x, y;
+	double people;
+} *points;
+static uint32_t n_points, points_size;
+
+static struct join {
+	uint16_t d;
+	int32_t station;
+	bool road;		/* there is a road within MAX_JOIN */
+} *joins;
+
+static struct seg {
+	uint32_t a, b;
+	int ax, ay, bx, by;	/* copied, to keep the search in the cache */
+	uint16_t len;
+} *segs;
+static uint32_t n_segs;
+
+static int org_x, org_y;
+static int cols, rows;
+static uint32_t *bucket_first;	/* segments in each bucket, as CSR */
+static uint32_t *bucket_segs;
+
+static uint32_t *order;		/* points, by bucket */
+
+static uint32_t next_job_nr;
+
+
+/* ----- Reading ----------------------------------------------------------- */
+
+
+static void add_point(double lon, double lat, double people)
+{
+	if (people <= 0)
+		return;
+	if (lon < lon_min || lon > lon_max || lat < lat_min || lat > lat_max)
+		return;
+	if (clipping && !clip_inside(lat, lon))
+		return;
+
+	if (n_points == points_size) {
+		points_size = points_size ? 2*points_size : 1024*1024;
+		points = realloc(points, sizeof(struct point)*points_size);
+		if (!points) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	map_point(lat, lon, &points[n_points].x, &points[n_points].y);
+	points[n_points].people = people;
+	n_points++;
+}
+
+
+/* a header line is fine, as long as it's the first */
+
+static void read_csv(const char *name)
+{
+	char buf[MAX_LINE];
+	unsigned lineno = 0;
+	double lon, lat, people;
+	FILE *file;
+
+	file = fopen(name, "r");
+	if (!file) {
+		perror(name);
+		exit(1);
+	}
+	while (fgets(buf, sizeof(buf), file)) {
+		lineno++;
+		if (*buf == '#' || *buf == '\n' || *buf == '\r')
+			continue;
+		if (sscanf(buf, "%lf,%lf,%lf", &lon, &lat, &people) == 3)
+			add_point(lon, lat, people);
+		else if (lineno != 1)
+			goto fail;
+	}
+	fclose(file);
+	return;
+
+fail:
+	fprintf(stderr, "%s:%u: expected \"lon,lat,people\"\n", name, lineno);
+	exit(1);
+}
+
+
+struct grid {
+	unsigned cols, rows;
+	double lon, lat;	/* lower left corner */
+	double cell;		/* degrees */
+	double nodata;
+	bool swap;
+};
+
+
+static void read_header(const char *name, struct grid *g)
+{
+	char buf[MAX_LINE], key[MAX_LINE], value[MAX_LINE];
+	bool center = 0, big;
+	FILE *file;
+	int one = 1;
+
+	big = !*(const char *) &one;
+	g->cols = g->rows = 0;
+	g->cell = 0;
+	g->nodata = -9999;
+	g->swap = 0;
+
+	file = fopen(name, "r");
+	if (!file) {
+		perror(name);
+		exit(1);
+	}
+	while (fgets(buf, sizeof(buf), file)) {
+		if (sscanf(buf, "%s %s", key, value) != 2)
+			continue;
+		if (!strcasecmp(key, "ncols"))
+			g->cols = atoi(value);
+		else if (!strcasecmp(key, "nrows"))
+			g->rows = atoi(value);
+		else if (!strcasecmp(key, "xllcorner"))
+			g->lon = atof(value);
+		else if (!strcasecmp(key, "yllcorner"))
+			g->lat = atof(value);
+		else if (!strcasecmp(key, "xllcenter"))
+			g->lon = atof(value), center = 1;
+		else if (!strcasecmp(key, "yllcenter"))
+			g->lat = atof(value), center = 1;
+		else if (!strcasecmp(key, "cellsize"))
+			g->cell = atof(value);
+		else if (!strcasecmp(key, "nodata_value"))
+			g->nodata = atof(value);
+		else if (!strcasecmp(key, "byteorder"))
+			g->swap = big != !strcasecmp(value, "MSBFIRST");
+	}
+	fclose(file);
+	if (!g->cols || !g->rows || g->cell <= 0) {
+		fprintf(stderr, "%s: incomplete header\n", name);
+		exit(1);
+	}
+	if (center) {
+		g->lon -= g->cell/2;
+		g->lat -= g->cell/2;
+	}
+}
+
+
+static float get_float(const uint32_t *p, bool swap)
+{
+	uint32_t v = swap ? __builtin_bswap32(*p) : *p;
+	float f;
+
+	memcpy(&f, &v, sizeof(f));
+	return f;
+}
+
+
+/* rows go from north to south */
+
+static void read_grid(const char *name)
+{
+	struct grid g;
+	struct stat st;
+	const uint32_t *data;
+	char *hdr;
+	unsigned r, c;
+	float v;
+	int fd;
+
+	hdr = strdup(name);
+	if (!hdr) {
+		perror("strdup");
+		exit(1);
+	}
+	strcpy(hdr+strlen(hdr)-4, ".hdr");
+	read_header(hdr, &g);
+	free(hdr);
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		perror(name);
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		exit(1);
+	}
+	if ((uint64_t) st.st_size != (uint64_t) g.cols*g.rows*4) {
+		fprintf(stderr, "%s: expected %u x %u cells\n", name,
+		    g.cols, g.rows);
+		exit(1);
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+
+	for (r = 0; r != g.rows; r++)
+		for (c = 0; c != g.cols; c++) {
+			v = get_float(data+(size_t) r*g.cols+c, g.swap);
+			if (v != g.nodata)
+				add_point(g.lon+(c+0.5)*g.cell,
+				    g.lat+(g.rows-r-0.5)*g.cell, v);
+		}
+	munmap((void *) data, st.st_size);
+}
+
+
+static void read_population(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (len > 4 && !strcasecmp(name+len-4, ".flt"))
+		read_grid(name);
+	else
+		read_csv(name);
+}
+
+
+/* ----- Spatial index ----------------------------------------------------- */
+
+
+static int bucket_of(int v, int org)
+{
+	return floor((double) (v-org)/BUCKET);
+}
+
+
+static void make_segs(void)
+{
+	uint32_t n, m, e;
+
+	segs = zalloc_array(n_edges, sizeof(struct seg));
+	for (n = 0; n != n_nodes; n++)
+		for (e = edge_first[n]; e != edge_first[n+1]; e++) {
+			m = edge_to[e];
+			if (node_id[m] <= node_id[n])
+				continue;
+			segs[n_segs].a = n;
+			segs[n_segs].b = m;
+			segs[n_segs].ax = node_x[n];
+			segs[n_segs].ay = node_y[n];
+			segs[n_segs].bx = node_x[m];
+			segs[n_segs].by = node_y[m];
+			segs[n_segs].len = edge_len[e];
+			n_segs++;
+		}
+}
+
+
+static void bounds(void)
+{
+	int xmax, ymax;
+
+	graph_bounds(&org_x, &xmax, &org_y, &ymax);
+	cols = bucket_of(xmax, org_x)+1;
+	rows = bucket_of(ymax, org_y)+1;
+}
+
+
+static void seg_buckets(const struct seg *s, int *c0, int *c1, int *r0,
+    int *r1)
+{
+	*c0 = bucket_of(s->ax < s->bx ? s->ax : s->bx, org_x);
+	*c1 = bucket_of(s->ax < s->bx ? s->bx : s->ax, org_x);
+	*r0 = bucket_of(s->ay < s->by ? s->ay : s->by, org_y);
+	*r1 = bucket_of(s->ay < s->by ? s->by : s->ay, org_y);
+}
+
+
+static void make_index(void)
+{
+	const struct seg *s;
+	uint32_t *pos;
+	int c, r, c0, c1, r0, r1;
+	size_t i, n_buckets;
+
+	bounds();
+	n_buckets = (size_t) cols*rows;
+	bucket_first = zalloc_array(n_buckets+1, sizeof(uint32_t));
+	for (s = segs; s != segs+n_segs; s++) {
+		seg_buckets(s, &c0, &c1, &r0, &r1);
+		for (r = r0; r <= r1; r++)
+			for (c = c0; c <= c1; c++)
+				bucket_first[(size_t) r*cols+c+1]++;
+	}
+	for (i = 0; i != n_buckets; i++)
+		bucket_first[i+1] += bucket_first[i];
+
+	bucket_segs = zalloc_array(bucket_first[n_buckets], sizeof(uint32_t));
+	pos = zalloc_array(n_buckets, sizeof(uint32_t));
+	memcpy(pos, bucket_first, sizeof(uint32_t)*n_buckets);
+	for (s = segs; s != segs+n_segs; s++) {
+		seg_buckets(s, &c0, &c1, &r0, &r1);
+		for (r = r0; r <= r1; r++)
+			for (c = c0; c <= c1; c++)
+				bucket_segs[pos[(size_t) r*cols+c]++] =
+				    s-segs;
+	}
+	free(pos);
+}
+
+
+/*
+ * Points come in any order. Joining them bucket by bucket, with a counting
+ * sort, keeps the segments of the neighbourhood in the cache. Points outside
+ * the grid go to the nearest bucket on its edge.
+ */
+
+static uint32_t point_bucket(const struct point *p)
+{
+	int c = bucket_of(p->x, org_x);
+	int r = bucket_of(p->y, org_y);
+
+	c = c < 0 ? 0 : c >= cols ? cols-1 : c;
+	r = r < 0 ? 0 : r >= rows ? rows-1 : r;
+	return r*cols+c;
+}
+
+
+static void sort_points(void)
+{
+	size_t n_buckets = (size_t) cols*rows;
+	uint32_t *first, i;
+
+	first = zalloc_array(n_buckets+1, sizeof(uint32_t));
+	for (i = 0; i != n_points; i++)
+		first[point_bucket(points+i)+1]++;
+	for (i = 0; i != n_buckets; i++)
+		first[i+1] += first[i];
+	order = zalloc_array(n_points, sizeof(uint32_t));
+	for (i = 0; i != n_points; i++)
+		order[first[point_bucket(points+i)]++] = i;
+	free(first);
+}
+
+
+/* ----- Join -------------------------------------------------------------- */
+
+
+/* squared distance from "p" to segment "s", and where along "s" (0 ... 1) */
+
+static double seg_dist(const struct point *p, const struct seg *s, double *f)
+{
+	double ax = s->ax, ay = s->ay;
+	double dx = s->bx-ax, dy = s->by-ay;
+	double len2 = dx*dx+dy*dy;
+	double t = 0;
+
+	if (len2)
+		t = ((p->x-ax)*dx+(p->y-ay)*dy)/len2;
+	if (t < 0)
+		t = 0;
+	if (t > 1)
+		t = 1;
+	*f = t;
+	dx = ax+t*dx-p->x;
+	dy = ay+t*dy-p->y;
+	return dx*dx+dy*dy;
+}
+
+
+static void search_bucket(const struct point *p, int c, int r,
+    uint32_t *best, double *best_d2, double *best_f)
+{
+	size_t i = (size_t) r*cols+c;
+	double d2, f;
+	uint32_t j;
+
+	if (c < 0 || c >= cols || r < 0 || r >= rows)
+		return;
+	for (j = bucket_first[i]; j != bucket_first[i+1]; j++) {
+		d2 = seg_dist(p, segs+bucket_segs[j], &f);
+		if (d2 < *best_d2 ||
+		    (d2 == *best_d2 && bucket_segs[j] < *best)) {
+			*best = bucket_segs[j];
+			*best_d2 = d2;
+			*best_f = f;
+		}
+	}
+}
+
+
+static uint32_t nearest_seg(const struct point *p, double *f)
+{
+	uint32_t best = UINT32_MAX;
+	double best_d2 = (double) MAX_JOIN*MAX_JOIN;
+	int c = bucket_of(p->x, org_x);
+	int r = bucket_of(p->y, org_y);
+	int ring, i;
+	double gap;
+
+	for (ring = 0; (ring-1)*BUCKET <= MAX_JOIN; ring++) {
+		/* nothing in this ring can be closer */
+		gap = (ring-1)*BUCKET;
+		if (ring && best_d2 <= gap*gap)
+			break;
+		if (!ring) {
+			search_bucket(p, c, r, &best, &best_d2, f);
+			continue;
+		}
+		for (i = -ring; i != ring; i++) {
+			search_bucket(p, c+i, r-ring, &best, &best_d2, f);
+			search_bucket(p, c+ring, r+i, &best, &best_d2, f);
+			search_bucket(p, c-i, r+ring, &best, &best_d2, f);
+			search_bucket(p, c-ring, r-i, &best, &best_d2, f);
+		}
+	}
+	return best;
+}
+
+
+static void join_point(const struct point *p, struct join *j)
+{
+	const struct seg *s;
+	uint32_t best;
+	double f;
+	int da, db;
+
+	j->d = UNREACHABLE;
+	j->station = -1;
+	best = nearest_seg(p, &f);
+	j->road = best != UINT32_MAX;
+	if (!j->road)
+		return;
+	s = segs+best;
+	da = node_distance[s->a]+f*s->len;
+	db = node_distance[s->b]+(1-f)*s->len;
+	if (da < db ||
+	    (da == db && node_nearest[s->a] <= node_nearest[s->b])) {
+		j->d = da < UNREACHABLE ? da : UNREACHABLE;
+		j->station = node_nearest[s->a];
+	} else {
+		j->d = db < UNREACHABLE ? db : UNREACHABLE;
+		j->station = node_nearest[s->b];
+	}
+	if (j->d == UNREACHABLE)
+		j->station = -1;
+}
+
+
+static void join_points(void *user, unsigned thread)
+{
+	uint32_t block, i, end;
+
+	while (1) {
+		block = next_job(&next_job_nr);
+		if ((uint64_t) block*BLOCK >= n_points)
+			break;
+		end = n_points-block*BLOCK < BLOCK ?
+		    n_points : block*BLOCK+BLOCK;
+		for (i = block*BLOCK; i != end; i++)
+			join_point(points+order[i], joins+order[i]);
+	}
+}
+
+
+/* ----- Output ------------------------------------------------------------ */
+
+
+void write_population(FILE *file, const char *name)
+{
+	double band[bands] = { 0 };
+	double total = 0, no_road = 0;
+	double *served;
+	uint32_t *stations;
+	unsigned n_stations, s, i;
+
+	read_population(name);
+	expand_distances();
+	make_segs();
+	make_index();
+
+	sort_points();
+	joins = zalloc_array(n_points, sizeof(struct join));
+	next_job_nr = 0;
+	parallel(join_points, NULL);
+
+	n_stations = count_routes();
+	stations = station_nodes();
+	served = zalloc_array(n_stations, sizeof(double));
+	for (i = 0; i != n_points; i++) {
+		total += points[i].people;
+		band[classify(joins[i].d)] += points[i].people;
+		if (joins[i].station >= 0)
+			served[joins[i].station] += points[i].people;
+		if (!joins[i].road)
+			no_road += points[i].people;
+	}
+	fprintf(stderr, "%u population points, %.0f people\n",
+	    n_points, total);
+
+	fprintf(file, "# %.0f people, %.0f farther than %u m from any road\n",
+	    total, no_road, MAX_JOIN);
+	fprintf(file, "# band people percent\n");
+	fprintf(file, "good %.0f %.2f\n", band[band_good],
+	    total ? band[band_good]*100/total : 0);
+	fprintf(file, "average %.0f %.2f\n", band[band_average],
+	    total ? band[band_average]*100/total : 0);
+	fprintf(file, "bad %.0f %.2f\n", band[band_bad],
+	    total ? band[band_bad]*100/total : 0);
+	fprintf(file, "remote %.0f %.2f\n", band[band_remote],
+	    total ? band[band_remote]*100/total : 0);
+
+	fprintf(file, "\n# people by nearest station\n");
+	fprintf(file, "# station x y people percent\n");
+	for (s = 0; s != n_stations; s++)
+		fprintf(file, "%d %d %d %.0f %.2f\n",
+		    node_id[stations[s]], node_x[stations[s]],
+		    node_y[stations[s]], served[s],
+		    total ? served[s]*100/total : 0);
+
+	free(served);
+	free(stations);
+	free(joins);
+	free(order);
+	free(points);
+	free(segs);
+	free(bucket_first);
+	free(bucket_segs);
+}
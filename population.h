@@ -0,0 +1,34 @@
+/*
+ * population.h - Coverage by population
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef POPULATION_H
+#define	POPULATION_H
+
+#include <stdio.h>
+
+
+/*
+ * The population comes either as CSV points, "lon,lat,people" per line, or as
+ * a grid of 32-bit floats in the ESRI .flt format, with the header in the
+ * .hdr file next to it. Each point, or the center of each cell, counts where
+ * it is on the nearest road, if there is one within MAX_JOIN meters. Points
+ * outside the bounding box, or outside the boundary polygon, are ignored.
+ */
+
+#define	MAX_JOIN	500	/* m */
+
+
+/*
+ * Write the population in each distance band, and the population served by
+ * each station, like write_closure does with road length.
+ */
+
+void write_population(FILE *file, const char *name);
+
+#endif /* POPULATION_H */
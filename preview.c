@@ -0,0 +1,449 @@
+/*
+ * preview.c - Routing on a coarsened graph
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * A coarse graph takes the place of the full one in the node and edge arrays,
+ * so that routing and all the output work on it unchanged. The full graph is
+ * kept aside, and each level maps the nodes of the full graph to its own, so
+ * that the levels can be compared node by node. Coarse nodes are numbered in
+ * the order of their first full node, and thus keep the locality of the
+ * Hilbert order.
+ *
+ * A coarse node takes its ID and flags from one of its nodes, preferring an
+ * eligible station, then any station, then the lowest ID. Edges inside a cell
+ * vanish, and parallel edges merge in select_edges. Since prepare_routing
+ * measures the edges between the cell centers, each node can be off by up to
+ * half a cell diagonal at either end of its path, and paths through a cell
+ * get shorter or longer by about as much. How much this matters in practice
+ * is what preview_errors tells.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "util.h"
+#include "profile.h"
+#include "db.h"
+#include "route.h"
+#include "stats.h"
+#include "preview.h"
+
+
+#define	MAX_LEVELS	16
+
+
+static struct level {
+	unsigned cell;		/* 0: the full graph */
+	unsigned nodes, edges;
+	double seconds;
+	uint16_t *d;		/* distance of each node of the full graph */
+} levels[MAX_LEVELS];
+static unsigned n_levels;
+
+/* the full graph, while a coarse one is in its place */
+
+static struct graph {
+	int *id, *x, *y;
+	int32_t *lat, *lon;
+	uint8_t *flags;
+	uint16_t *distance;
+	int32_t *nearest;
+	uint32_t *first, *to;
+	uint16_t *len;
+	uint8_t *cls;
+	unsigned n_nodes, n_edges;
+	uint32_t *stops;
+} full;
+
+static uint32_t *cell_node;	/* full node -> node of the current graph */
+static bool coarse;		/* the current graph is not the full one */
+static struct timespec t0;	/* when the last level started */
+
+
+static double seconds_since(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec-t->tv_sec+(now.tv_nsec-t->tv_nsec)/1e9;
+}
+
+
+/* ----- Graphs ------------------------------------------------------------ */
+
+
+static void save_full(void)
+{
+	full.id = node_id;
+	full.x = node_x;
+	full.y = node_y;
+	full.lat = node_lat;
+	full.lon = node_lon;
+	full.flags = node_flags;
+	full.distance = node_distance;
+	full.nearest = node_nearest;
+	full.first = edge_first;
+	full.to = edge_to;
+	full.len = edge_len;
+	full.cls = edge_class;
+	full.n_nodes = n_nodes;
+	full.n_edges = n_edges;
+	full.stops = alloc_array(n_line_stops, sizeof(uint32_t));
+	memcpy(full.stops, line_stops, sizeof(uint32_t)*n_line_stops);
+}
+
+
+static void free_coarse(void)
+{
+	if (!coarse)
+		return;
+	free(node_id);
+	free(node_x);
+	free(node_y);
+	free(node_lat);
+	free(node_lon);
+	free(node_flags);
+	free(node_distance);
+	free(node_nearest);
+	free(edge_first);
+	free(edge_to);
+	free(edge_len);
+	free(edge_class);
+	coarse = 0;
+}
+
+
+static void use_full(void)
+{
+	unsigned n;
+
+	free_coarse();
+	node_id = full.id;
+	node_x = full.x;
+	node_y = full.y;
+	node_lat = full.lat;
+	node_lon = full.lon;
+	node_flags = full.flags;
+	node_distance = full.distance;
+	node_nearest = full.nearest;
+	edge_first = full.first;
+	edge_to = full.to;
+	edge_len = full.len;
+	edge_class = full.cls;
+	n_nodes = full.n_nodes;
+	n_edges = full.n_edges;
+	memcpy(line_stops, full.stops, sizeof(uint32_t)*n_line_stops);
+	for (n = 0; n != n_nodes; n++)
+		cell_node[n] = n;
+}
+
+
+/* ----- Coarsening -------------------------------------------------------- */
+
+
+struct cell_key {
+	uint64_t key;		/* row << 32 | column */
+	uint32_t n;
+};
+
+
+static int key_comp(const void *a, const void *b)
+{
+	const struct cell_key *ka = a, *kb = b;
+
+	if (ka->key != kb->key)
+		return ka->key < kb->key ? -1 : 1;
+	return ka->n < kb->n ? -1 : ka->n > kb->n;
+}
+
+
+/* 0: eligible station, 1: other station, 2: anything else */
+
+static int rank(unsigned n)
+{
+	if (!(full.flags[n] & NODE_STATION))
+		return 2;
+	return allow_proposed || !(full.flags[n] & NODE_PROPOSED) ? 0 : 1;
+}
+
+
+static bool better_rep(unsigned a, unsigned b)
+{
+	if (rank(a) != rank(b))
+		return rank(a) < rank(b);
+	return full.id[a] < full.id[b];
+}
+
+
+static int snap(int v, unsigned cell)
+{
+	return floor((double) v/cell);
+}
+
+
+static void coarsen(unsigned cell)
+{
+	struct cell_key *keys;
+	uint32_t *group, *rep, row, col;
+	unsigned n, c, i, n_cells = 0;
+	uint32_t e;
+
+	free_coarse();
+
+	keys = alloc_array(full.n_nodes, sizeof(struct cell_key));
+	for (n = 0; n != full.n_nodes; n++) {
+		row = snap(full.y[n], cell);
+		col = snap(full.x[n], cell);
+		keys[n].key = (uint64_t) row << 32 | col;
+		keys[n].n = n;
+	}
+	qsort(keys, full.n_nodes, sizeof(struct cell_key), key_comp);
+
+	group = alloc_array(full.n_nodes, sizeof(uint32_t));
+	for (i = 0; i != full.n_nodes; i++) {
+		if (i && keys[i].key != keys[i-1].key)
+			n_cells++;
+		group[keys[i].n] = n_cells;
+	}
+	if (full.n_nodes)
+		n_cells++;
+	free(keys);
+
+	/* number the cells in the order of their first node */
+	rep = alloc_array(n_cells, sizeof(uint32_t));
+	for (c = 0; c != n_cells; c++)
+		rep[c] = UINT32_MAX;
+	n_nodes = 0;
+	for (n = 0; n != full.n_nodes; n++) {
+		if (rep[group[n]] == UINT32_MAX)
+			rep[group[n]] = n_nodes++;
+		cell_node[n] = rep[group[n]];
+	}
+	free(group);
+
+	for (c = 0; c != n_cells; c++)
+		rep[c] = UINT32_MAX;
+	for (n = 0; n != full.n_nodes; n++) {
+		c = cell_node[n];
+		if (rep[c] == UINT32_MAX || better_rep(n, rep[c]))
+			rep[c] = n;
+	}
+
+	node_id = alloc_array(n_nodes, sizeof(int));
+	node_x = alloc_array(n_nodes, sizeof(int));
+	node_y = alloc_array(n_nodes, sizeof(int));
+	node_lat = alloc_array(n_nodes, sizeof(int32_t));
+	node_lon = alloc_array(n_nodes, sizeof(int32_t));
+	node_flags = alloc_array(n_nodes, sizeof(uint8_t));
+	node_distance = alloc_array(n_nodes, sizeof(uint16_t));
+	node_nearest = alloc_array(n_nodes, sizeof(int32_t));
+	coarse = 1;
+
+	for (c = 0; c != n_nodes; c++) {
+		n = rep[c];
+		node_id[c] = full.id[n];
+		node_x[c] = (snap(full.x[n], cell)+0.5)*cell;
+		node_y[c] = (snap(full.y[n], cell)+0.5)*cell;
+		node_lat[c] = full.lat[n];
+		node_lon[c] = full.lon[n];
+		node_flags[c] = full.flags[n];
+	}
+	free(rep);
+
+	for (n = 0; n != full.n_nodes; n++)
+		for (e = full.first[n]; e != full.first[n+1]; e++)
+			if (cell_node[n] != cell_node[full.to[e]])
+				link_nodes(cell_node[n], cell_node[full.to[e]],
+				    full.cls[e], tok_none, tok_none);
+	make_edges();
+	select_edges();
+
+	for (i = 0; i != n_line_stops; i++)
+		line_stops[i] = cell_node[full.stops[i]];
+}
+
+
+static void use_level(const struct level *l)
+{
+	if (l->cell)
+		coarsen(l->cell);
+	else
+		use_full();
+}
+
+
+/* ----- Levels ------------------------------------------------------------ */
+
+
+static double edge_length(unsigned a, unsigned b)
+{
+	return hypot(full.x[a]-full.x[b], full.y[a]-full.y[b]);
+}
+
+
+static enum band edge_band(const uint16_t *d, unsigned a, unsigned b)
+{
+	return classify((d[a]+d[b])/2);
+}
+
+
+static void print_name(const struct level *l)
+{
+	if (l->cell)
+		fprintf(stderr, "%4u m cells:", l->cell);
+	else
+		fprintf(stderr, "full graph:  ");
+}
+
+
+static void print_level(const struct level *l)
+{
+	double band[bands] = { 0 };
+	double total = 0, len;
+	unsigned n, m;
+	uint32_t e;
+
+	for (n = 0; n != full.n_nodes; n++)
+		for (e = full.first[n]; e != full.first[n+1]; e++) {
+			m = full.to[e];
+			if (full.id[m] <= full.id[n])
+				continue;
+			len = edge_length(n, m);
+			band[edge_band(l->d, n, m)] += len;
+			total += len;
+		}
+	if (!total)
+		total = 1;
+	print_name(l);
+	fprintf(stderr, " %u nodes %u edges, %.2f s, good %.1f%% "
+	    "average %.1f%% bad %.1f%% remote %.1f%%\n",
+	    l->nodes, l->edges, l->seconds,
+	    band[band_good]*100/total, band[band_average]*100/total,
+	    band[band_bad]*100/total, band[band_remote]*100/total);
+}
+
+
+/* the distances of the current graph, for each node of the full graph */
+
+static void record(struct level *l)
+{
+	unsigned n;
+
+	expand_distances();
+	l->d = alloc_array(full.n_nodes, sizeof(uint16_t));
+	for (n = 0; n != full.n_nodes; n++)
+		l->d[n] = node_distance[cell_node[n]];
+	l->nodes = n_nodes;
+	l->edges = n_edges;
+	print_level(l);
+}
+
+
+/*
+ * Only nodes with edges count, since the others never get a distance of
+ * their own. Roads are in another band if their middle is.
+ */
+
+static void compare(const struct level *l, const struct level *ref)
+{
+	unsigned hist[UNREACHABLE+1] = { 0 };
+	unsigned n, m, diff, max = 0, p95;
+	double changed = 0, total = 0, len;
+	uint64_t count = 0, sum = 0, abs_sum = 0;
+	uint32_t e;
+
+	for (n = 0; n != full.n_nodes; n++) {
+		if (full.first[n] == full.first[n+1])
+			continue;
+		diff = abs(l->d[n]-ref->d[n]);
+		hist[diff]++;
+		abs_sum += diff;
+		if (diff > max)
+			max = diff;
+		count++;
+		for (e = full.first[n]; e != full.first[n+1]; e++) {
+			m = full.to[e];
+			if (full.id[m] <= full.id[n])
+				continue;
+			len = edge_length(n, m);
+			if (edge_band(l->d, n, m) != edge_band(ref->d, n, m))
+				changed += len;
+			total += len;
+		}
+	}
+	for (p95 = 0; p95 != UNREACHABLE; p95++) {
+		sum += hist[p95];
+		if (sum*20 >= count*19)
+			break;
+	}
+	print_name(l);
+	fprintf(stderr, " error max %u m, 95%% %u m, mean %.1f m, "
+	    "%.1f%% of the roads in another band\n", max, p95,
+	    count ? (double) abs_sum/count : 0, total ? changed*100/total : 0);
+}
+
+
+/* ----- Interface --------------------------------------------------------- */
+
+
+void add_preview(unsigned cell)
+{
+	if (n_levels == MAX_LEVELS) {
+		fprintf(stderr, "too many preview levels (max. %u)\n",
+		    MAX_LEVELS);
+		exit(1);
+	}
+	levels[n_levels++].cell = cell;
+}
+
+
+bool have_previews(void)
+{
+	return n_levels;
+}
+
+
+void preview(void)
+{
+	struct level *l;
+
+	/* errors are against the full graph, and so is the output */
+	if (levels[n_levels-1].cell)
+		add_preview(0);
+	save_full();
+	cell_node = alloc_array(full.n_nodes, sizeof(uint32_t));
+	for (l = levels; l != levels+n_levels-1; l++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		use_level(l);
+		prepare_routing();
+		find_distances();
+		l->seconds = seconds_since(&t0);
+		record(l);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	use_level(l);
+}
+
+
+void preview_errors(void)
+{
+	struct level *last = levels+n_levels-1;
+	const struct level *l;
+
+	last->seconds = seconds_since(&t0);
+	record(last);
+	for (l = levels; l != last; l++)
+		compare(l, last);
+}
@@ -0,0 +1,35 @@
+/*
+ * preview.h - Routing on a coarsened graph
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef PREVIEW_H
+#define	PREVIEW_H
+
+#include <stdbool.h>
+
+
+/*
+ * Each level snaps the nodes to the centers of cells of "cell" x "cell"
+ * meters, and merges the nodes and edges that end up on top of each other.
+ * Cell size 0 is the full graph.
+ *
+ * preview adds a last level with cell size 0 if the last one added isn't
+ * already that. It routes all levels but the last one, in the order they
+ * were added, and prints the coverage of each as soon as it has it. It then
+ * leaves the full graph in place, for the regular routing and output.
+ * preview_errors compares each level with the full graph, once that is
+ * routed.
+ */
+
+void add_preview(unsigned cell);
+bool have_previews(void);
+
+void preview(void);
+void preview_errors(void);
+
+#endif /* PREVIEW_H */
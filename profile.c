@@ -0,0 +1,225 @@
+/*
+ * profile.c - Walking profiles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "profile.h"
+
+
+#define	HASH_SIZE	256	/* power of two, well above "tokens" */
+
+
+static const char *token_name[tokens] = {
+	[tok_highway]		= "highway",
+	[tok_access]		= "access",
+	[tok_foot]		= "foot",
+	[tok_route]		= "route",
+	[tok_ref]		= "ref",
+
+	[tok_motorway]		= "motorway",
+	[tok_motorway_link]	= "motorway_link",
+	[tok_trunk]		= "trunk",
+	[tok_trunk_link]	= "trunk_link",
+	[tok_primary]		= "primary",
+	[tok_primary_link]	= "primary_link",
+	[tok_secondary]		= "secondary",
+	[tok_secondary_link]	= "secondary_link",
+	[tok_tertiary]		= "tertiary",
+	[tok_tertiary_link]	= "tertiary_link",
+	[tok_unclassified]	= "unclassified",
+	[tok_residential]	= "residential",
+	[tok_living_street]	= "living_street",
+	[tok_service]		= "service",
+	[tok_road]		= "road",
+	[tok_pedestrian]	= "pedestrian",
+	[tok_footway]		= "footway",
+	[tok_path]		= "path",
+	[tok_steps]		= "steps",
+	[tok_cycleway]		= "cycleway",
+	[tok_bridleway]		= "bridleway",
+	[tok_track]		= "track",
+	[tok_corridor]		= "corridor",
+	[tok_platform]		= "platform",
+	[tok_construction]	= "construction",
+	[tok_proposed]		= "proposed",
+
+	[tok_yes]		= "yes",
+	[tok_no]		= "no",
+	[tok_private]		= "private",
+	[tok_permissive]	= "permissive",
+	[tok_designated]	= "designated",
+	[tok_destination]	= "destination",
+
+	[tok_subway_entrance]	= "subway_entrance",
+	[tok_subway]		= "subway",
+};
+
+
+/* ----- Profiles ---------------------------------------------------------- */
+
+
+static const struct profile profiles[] = {
+	{
+		/* pedestrians: no motorways, stairs and busy roads are slow */
+		.name	= "walk",
+		.access	= 1,
+		.cost	= {
+			[tok_trunk]		= 1.3,
+			[tok_trunk_link]	= 1.3,
+			[tok_primary]		= 1.2,
+			[tok_primary_link]	= 1.2,
+			[tok_secondary]		= 1.1,
+			[tok_secondary_link]	= 1.1,
+			[tok_tertiary]		= 1.05,
+			[tok_tertiary_link]	= 1.05,
+			[tok_unclassified]	= 1,
+			[tok_residential]	= 1,
+			[tok_living_street]	= 1,
+			[tok_service]		= 1,
+			[tok_road]		= 1,
+			[tok_pedestrian]	= 1,
+			[tok_footway]		= 1,
+			[tok_path]		= 1.1,
+			[tok_steps]		= 1.5,
+			[tok_cycleway]		= 1.1,
+			[tok_bridleway]		= 1.2,
+			[tok_track]		= 1.2,
+			[tok_corridor]		= 1,
+			[tok_platform]		= 1,
+		},
+	},
+	{
+		/* only ways meant for pedestrians, and quiet streets */
+		.name	= "quiet",
+		.access	= 1,
+		.cost	= {
+			[tok_tertiary]		= 1.2,
+			[tok_tertiary_link]	= 1.2,
+			[tok_unclassified]	= 1,
+			[tok_residential]	= 1,
+			[tok_living_street]	= 1,
+			[tok_service]		= 1.1,
+			[tok_pedestrian]	= 1,
+			[tok_footway]		= 1,
+			[tok_path]		= 1,
+			[tok_steps]		= 1.5,
+			[tok_corridor]		= 1,
+			[tok_platform]		= 1,
+		},
+	},
+	{
+		/*
+		 * What we used to do, to reproduce old output: any
+		 * highway=..., including motorways, all the same.
+		 */
+		.name	= "any",
+		.any	= 1,
+	},
+};
+
+/* the first one, "walk", is the default */
+
+const struct profile *profile = profiles;
+
+
+bool select_profile(const char *name)
+{
+	const struct profile *p;
+
+	for (p = profiles; p != profiles+sizeof(profiles)/sizeof(*p); p++)
+		if (!strcmp(p->name, name)) {
+			profile = p;
+			return 1;
+		}
+	return 0;
+}
+
+
+void list_profiles(FILE *file)
+{
+	const struct profile *p;
+
+	for (p = profiles; p != profiles+sizeof(profiles)/sizeof(*p); p++)
+		fprintf(file, "%s%s", p == profiles ? "" : ", ", p->name);
+}
+
+
+bool profile_keep(enum token highway, enum token access, enum token foot)
+{
+	if (highway == tok_none)
+		return 0;
+	if (profile->any)
+		return 1;
+	if (!profile->cost[highway])
+		return 0;
+	if (!profile->access)
+		return 1;
+	switch (foot) {
+	case tok_yes:
+	case tok_permissive:
+	case tok_designated:
+		return 1;
+	case tok_no:
+	case tok_private:
+		return 0;
+	default:
+		break;
+	}
+	return access != tok_no && access != tok_private;
+}
+
+
+/* ----- Interning --------------------------------------------------------- */
+
+
+static uint8_t hash_table[HASH_SIZE];	/* 0 (tok_none) is "empty" */
+
+
+static unsigned hash(const char *s)
+{
+	uint32_t h = 2166136261u;	/* FNV-1a */
+
+	while (*s)
+		h = (h ^ (uint8_t) *s++)*16777619u;
+	return h & (HASH_SIZE-1);
+}
+
+
+static void init_hash(void)
+{
+	enum token t;
+	unsigned h;
+
+	for (t = tok_other+1; t != tokens; t++) {
+		h = hash(token_name[t]);
+		while (hash_table[h])
+			h = (h+1) & (HASH_SIZE-1);
+		hash_table[h] = t;
+	}
+}
+
+
+enum token intern(const char *s)
+{
+	static bool initialized = 0;
+	unsigned h;
+
+	if (!initialized) {
+		init_hash();
+		initialized = 1;
+	}
+	for (h = hash(s); hash_table[h]; h = (h+1) & (HASH_SIZE-1))
+		if (!strcmp(token_name[hash_table[h]], s))
+			return hash_table[h];
+	return tok_other;
+}
@@ -0,0 +1,112 @@
+/*
+ * profile.h - Walking profiles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef PROFILE_H
+#define	PROFILE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+
+/*
+ * Tag keys and values we care about are interned, so that the parser only
+ * hashes each string once instead of comparing it against all candidates.
+ */
+
+enum token {
+	tok_none = 0,		/* tag is absent */
+	tok_other,		/* anything we don't know */
+
+	/* keys */
+	tok_highway,
+	tok_access,
+	tok_foot,
+	tok_route,
+	tok_ref,
+
+	/* highway=... */
+	tok_motorway,
+	tok_motorway_link,
+	tok_trunk,
+	tok_trunk_link,
+	tok_primary,
+	tok_primary_link,
+	tok_secondary,
+	tok_secondary_link,
+	tok_tertiary,
+	tok_tertiary_link,
+	tok_unclassified,
+	tok_residential,
+	tok_living_street,
+	tok_service,
+	tok_road,
+	tok_pedestrian,
+	tok_footway,
+	tok_path,
+	tok_steps,
+	tok_cycleway,
+	tok_bridleway,
+	tok_track,
+	tok_corridor,
+	tok_platform,
+	tok_construction,
+	tok_proposed,
+
+	/* access=..., foot=... */
+	tok_yes,
+	tok_no,
+	tok_private,
+	tok_permissive,
+	tok_designated,
+	tok_destination,
+
+	/* railway=..., route=... */
+	tok_subway_entrance,
+	tok_subway,
+
+	tokens
+};
+
+
+/*
+ * A way is kept if its highway class has a non-zero cost. The cost is the
+ * factor by which walking along the way is "longer" than its actual length.
+ * Profiles that honour access restrictions drop ways with access=no or
+ * access=private, unless foot=... explicitly allows walking.
+ */
+
+struct profile {
+	const char *name;
+	bool any;		/* keep any highway=..., at cost 1 */
+	bool access;		/* honour access=... and foot=... */
+	float cost[tokens];	/* indexed by highway class */
+};
+
+
+extern const struct profile *profile;
+
+
+enum token intern(const char *s);
+
+bool select_profile(const char *name);
+void list_profiles(FILE *file);
+
+/*
+ * Decide whether to keep a way, given the values of its highway, access, and
+ * foot tags. The highway class is then used for profile_cost.
+ */
+
+bool profile_keep(enum token highway, enum token access, enum token foot);
+
+static inline float profile_cost(enum token cls)
+{
+	return profile->any ? 1 : profile->cost[cls];
+}
+
+#endif /* PROFILE_H */
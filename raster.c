@@ -0,0 +1,315 @@
+/*
+ * raster.c - Detour ratio on a raster
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * The straight-line distance to the nearest station is an exact Euclidean
+ * distance transform (Meijster et al.), which is separable: first each
+ * column, then each row. The column pass runs over whole rows at a time, so
+ * that the compiler can vectorize it, and both passes are split among the
+ * threads.
+ */
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "db.h"
+#include "route.h"
+#include "parallel.h"
+#include "raster.h"
+
+
+#define	COLUMNS		256	/* columns per job of the column pass */
+#define	MIN_RATIO	1.0	/* histogram of the ratio, in steps of 0.1 */
+#define	RATIO_BINS	20	/* the last bin has everything above */
+
+
+static unsigned cell;
+static int org_x, org_y;
+static uint32_t cols, rows;
+
+static uint32_t *g;		/* distance in cells, then squared distance */
+static uint16_t *net;		/* network distance, UNREACHABLE if none */
+
+static uint32_t next_job_nr;
+
+
+/* ----- Raster ------------------------------------------------------------ */
+
+
+static void bounds(void)
+{
+	int xmin, xmax, ymin, ymax;
+
+	graph_bounds(&xmin, &xmax, &ymin, &ymax);
+	org_x = xmin;
+	org_y = ymin;
+	cols = (xmax-xmin)/cell+1;
+	rows = (ymax-ymin)/cell+1;
+}
+
+
+static inline uint32_t cell_of(int x, int y)
+{
+	return (y-org_y)/(int) cell*cols+(x-org_x)/(int) cell;
+}
+
+
+/* ----- Distance transform ------------------------------------------------ */
+
+
+/*
+ * Cells start at 0 if they have a station, "infinity" otherwise. Each row
+ * then only depends on the previous one, in either direction.
+ */
+
+static void min_plus_one(uint32_t *restrict row, const uint32_t *restrict prev,
+    size_t n)
+{
+	uint32_t d;
+	size_t x;
+
+	for (x = 0; x < n; x++) {
+		d = prev[x]+1;
+		row[x] = d < row[x] ? d : row[x];
+	}
+}
+
+
+static void column_pass(void *user, unsigned thread)
+{
+	uint32_t c0, c1, y;
+
+	while (1) {
+		c0 = next_job(&next_job_nr)*COLUMNS;
+		if (c0 >= cols)
+			break;
+		c1 = c0+COLUMNS < cols ? c0+COLUMNS : cols;
+		for (y = 1; y != rows; y++)
+			min_plus_one(g+y*cols+c0, g+(y-1)*cols+c0, c1-c0);
+		for (y = rows-1; y; y--)
+			min_plus_one(g+(y-1)*cols+c0, g+y*cols+c0, c1-c0);
+	}
+}
+
+
+static inline int64_t f(int64_t x, int64_t i, const uint32_t *gi)
+{
+	return (x-i)*(x-i)+(int64_t) gi[i]*gi[i];
+}
+
+
+static inline int64_t sep(int64_t i, int64_t u, const uint32_t *gi)
+{
+	return (u*u-i*i+(int64_t) gi[u]*gi[u]-(int64_t) gi[i]*gi[i])/
+	    (2*(u-i));
+}
+
+
+/*
+ * Find the lower envelope of the parabolas of each cell of the row, then
+ * read off the squared distance.
+ */
+
+static void row_pass(void *user, unsigned thread)
+{
+	uint32_t *s, *t, *gi, *row;
+	uint32_t y, u;
+	int64_t w;
+	int q;
+
+	s = malloc(sizeof(uint32_t)*cols);
+	t = malloc(sizeof(uint32_t)*cols);
+	gi = malloc(sizeof(uint32_t)*cols);
+	if (!s || !t || !gi) {
+		perror("malloc");
+		exit(1);
+	}
+
+	while (1) {
+		y = next_job(&next_job_nr);
+		if (y >= rows)
+			break;
+		row = g+y*cols;
+		for (u = 0; u != cols; u++)
+			gi[u] = row[u];
+
+		q = 0;
+		s[0] = t[0] = 0;
+		for (u = 1; u != cols; u++) {
+			while (q >= 0 && f(t[q], s[q], gi) > f(t[q], u, gi))
+				q--;
+			if (q < 0) {
+				q = 0;
+				s[0] = u;
+				continue;
+			}
+			w = 1+sep(s[q], u, gi);
+			if (w < cols) {
+				q++;
+				s[q] = u;
+				t[q] = w;
+			}
+		}
+		for (u = cols; u; u--) {
+			row[u-1] = f(u-1, s[q], gi);
+			if (u-1 == t[q])
+				q--;
+		}
+	}
+	free(s);
+	free(t);
+	free(gi);
+}
+
+
+static void distance_transform(void)
+{
+	uint32_t i;
+	unsigned n;
+
+	g = malloc(sizeof(uint32_t)*cols*rows);
+	if (!g) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i != cols*rows; i++)
+		g[i] = rows+cols;	/* farther than anything */
+	for (n = 0; n != n_nodes; n++)
+		if (eligible(n))
+			g[cell_of(node_x[n], node_y[n])] = 0;
+
+	next_job_nr = 0;
+	parallel(column_pass, NULL);
+	next_job_nr = 0;
+	parallel(row_pass, NULL);
+}
+
+
+/* ----- Network distance -------------------------------------------------- */
+
+
+/*
+ * We sample each segment at half the cell size, and take the shorter way to
+ * each sample, from either end.
+ */
+
+static void rasterize(void)
+{
+	unsigned n, m, i, steps;
+	uint32_t e, c;
+	double len, t, d, a, b;
+
+	net = malloc(sizeof(uint16_t)*cols*rows);
+	if (!net) {
+		perror("malloc");
+		exit(1);
+	}
+	for (c = 0; c != cols*rows; c++)
+		net[c] = UNREACHABLE;
+
+	for (n = 0; n != n_nodes; n++)
+		for (e = edge_first[n]; e != edge_first[n+1]; e++) {
+			m = edge_to[e];
+			if (node_id[m] <= node_id[n])
+				continue;
+			a = node_distance[n];
+			b = node_distance[m];
+			if (a >= UNREACHABLE && b >= UNREACHABLE)
+				continue;
+			len = hypot(node_x[m]-node_x[n], node_y[m]-node_y[n]);
+			steps = 2*len/cell+1;
+			for (i = 0; i <= steps; i++) {
+				t = (double) i/steps;
+				d = a+t*edge_len[e];
+				if (b+(1-t)*edge_len[e] < d)
+					d = b+(1-t)*edge_len[e];
+				if (d >= UNREACHABLE)
+					continue;
+				c = cell_of(node_x[n]+t*(node_x[m]-node_x[n]),
+				    node_y[n]+t*(node_y[m]-node_y[n]));
+				if (d < net[c])
+					net[c] = d;
+			}
+		}
+}
+
+
+/* ----- Output ------------------------------------------------------------ */
+
+
+/*
+ * Close to a station, both distances are dominated by where exactly in the
+ * cell the station and the road are, so we leave those cells out of the
+ * statistics.
+ */
+
+void write_detour(FILE *file, unsigned size)
+{
+	unsigned long hist[RATIO_BINS] = { 0 };
+	unsigned long cells = 0, over_15 = 0, over_2 = 0;
+	double sum = 0, straight, ratio;
+	uint32_t x, y, c;
+	int bin;
+
+	cell = size;
+	bounds();
+	distance_transform();
+	rasterize();
+
+	for (c = 0; c != cols*rows; c++) {
+		if (net[c] >= UNREACHABLE)
+			continue;
+		straight = sqrt(g[c])*cell;
+		if (straight < NEAR)
+			continue;
+		ratio = net[c]/straight;
+		bin = (ratio-MIN_RATIO)*10;
+		if (bin < 0)
+			bin = 0;
+		if (bin >= RATIO_BINS)
+			bin = RATIO_BINS-1;
+		hist[bin]++;
+		sum += ratio;
+		cells++;
+		if (ratio > 1.5)
+			over_15++;
+		if (ratio > 2)
+			over_2++;
+	}
+
+	fprintf(file, "# cell %u m, %u x %u\n", cell, cols, rows);
+	fprintf(file, "# cells %lu mean %.3f >1.5 %.2f%% >2 %.2f%%\n",
+	    cells, cells ? sum/cells : 0,
+	    cells ? over_15*100.0/cells : 0, cells ? over_2*100.0/cells : 0);
+	fprintf(file, "# ratio cells %%\n");
+	for (bin = 0; bin != RATIO_BINS; bin++)
+		fprintf(file, "# %.1f%s %lu %.2f\n", MIN_RATIO+bin/10.0,
+		    bin == RATIO_BINS-1 ? "+" : "", hist[bin],
+		    cells ? hist[bin]*100.0/cells : 0);
+
+	fprintf(file, "\n# x y straight(m) network(m) ratio\n");
+	for (y = 0; y != rows; y++)
+		for (x = 0; x != cols; x++) {
+			c = y*cols+x;
+			if (net[c] >= UNREACHABLE)
+				continue;
+			straight = sqrt(g[c])*cell;
+			fprintf(file, "%d %d %.0f %u %.2f\n",
+			    org_x+x*cell+cell/2, org_y+y*cell+cell/2, straight,
+			    net[c], straight ? net[c]/straight : 0);
+		}
+
+	free(g);
+	free(net);
+}
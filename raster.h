@@ -0,0 +1,25 @@
+/*
+ * raster.h - Detour ratio on a raster
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef RASTER_H
+#define	RASTER_H
+
+#include <stdio.h>
+
+
+/*
+ * Compare the walking distance to the nearest station with the straight-line
+ * distance, on a raster with cells of "cell" x "cell" meters. Writes
+ * statistics and, for each cell on the network, its coordinates, both
+ * distances, and their ratio.
+ */
+
+void write_detour(FILE *file, unsigned cell);
+
+#endif /* RASTER_H */
@@ -0,0 +1,773 @@
+/*
+ * route.c - Walking distance to the nearest station
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "profile.h"
+#include "db.h"
+#include "parallel.h"
+#include "route.h"
+
+
+#define	NONE	UINT32_MAX
+
+
+bool allow_proposed = 0;
+
+
+/* ----- Junction graph ---------------------------------------------------- */
+
+
+/*
+ * Most nodes are shape points with exactly two neighbours. We only route
+ * between "junctions", i.e., nodes with any other number of neighbours, and
+ * stations. The shape points between two junctions form a chain, which
+ * becomes a single edge of the junction graph. Nodes without any edges are
+ * neither junctions nor in a chain.
+ */
+
+static uint32_t *junction;	/* node -> junction, NONE if not a junction */
+static uint32_t *j_node;	/* junction -> node */
+static uint32_t n_junctions;
+
+static uint16_t *j_distance;
+static int32_t *j_nearest;
+
+static uint32_t *j_first;
+static uint32_t *j_to;
+static uint16_t *j_len;
+static uint32_t n_j_edges;
+
+static struct chain {
+	uint32_t a, b;		/* junctions at the ends */
+	uint32_t first;		/* first node in chain_nodes */
+	uint32_t n;		/* number of shape points */
+	uint32_t len;		/* from "a" to "b" (m) */
+} *chains;
+static uint32_t n_chains;
+
+static uint32_t *chain_nodes;	/* shape points, in order from "a" */
+static uint32_t n_chain_nodes;
+static uint32_t *node_chain;	/* node -> chain, NONE if not in a chain */
+static uint32_t *node_pos;	/* node -> distance from "a" along chain */
+
+static struct jlink {
+	uint32_t a, b;
+	uint32_t len;
+} *jlinks;
+static uint32_t n_jlinks;
+
+
+/*
+ * Lengths are 16 bits. Anything longer than UINT16_MAX is far beyond
+ * UNREACHABLE and never gets relaxed anyway, so we can just cut it off.
+ */
+
+static uint16_t short_len(double len)
+{
+	return len > UINT16_MAX ? UINT16_MAX : len;
+}
+
+
+static void add_jlink(uint32_t a, uint32_t b, uint32_t len)
+{
+	if (a == b)
+		return;
+	jlinks[n_jlinks].a = a;
+	jlinks[n_jlinks].b = b;
+	jlinks[n_jlinks].len = len;
+	n_jlinks++;
+}
+
+
+static uint32_t add_junction(unsigned n)
+{
+	junction[n] = n_junctions;
+	j_node[n_junctions] = n;
+	return n_junctions++;
+}
+
+
+/*
+ * Follow the chain that starts at junction "j" with edge "e" to the junction
+ * at its other end.
+ */
+
+static void walk_chain(uint32_t j, uint32_t e)
+{
+	struct chain *c = chains+n_chains;
+	uint32_t prev = j_node[j];
+	uint32_t cur = edge_to[e];
+	uint32_t pos = edge_len[e];
+
+	c->a = j;
+	c->first = n_chain_nodes;
+	while (junction[cur] == NONE) {
+		node_chain[cur] = n_chains;
+		node_pos[cur] = pos;
+		chain_nodes[n_chain_nodes++] = cur;
+
+		e = edge_first[cur];
+		if (edge_to[e] == prev)
+			e++;
+		prev = cur;
+		cur = edge_to[e];
+		pos += edge_len[e];
+	}
+	c->b = junction[cur];
+	c->n = n_chain_nodes-c->first;
+	c->len = pos;
+	n_chains++;
+
+	add_jlink(c->a, c->b, c->len);
+	add_jlink(c->b, c->a, c->len);
+}
+
+
+static void walk_junction(uint32_t j)
+{
+	uint32_t n = j_node[j];
+	uint32_t e, m;
+
+	for (e = edge_first[n]; e != edge_first[n+1]; e++) {
+		m = edge_to[e];
+		if (junction[m] != NONE)
+			add_jlink(j, junction[m], edge_len[e]);
+		else if (node_chain[m] == NONE)
+			walk_chain(j, e);
+		/* else we already came from the other end */
+	}
+}
+
+
+static void make_j_edges(void)
+{
+	const struct jlink *l;
+	uint32_t *next;
+	uint32_t j;
+
+	j_first = calloc(n_junctions+1, sizeof(uint32_t));
+	if (!j_first) {
+		perror("calloc");
+		exit(1);
+	}
+	for (l = jlinks; l != jlinks+n_jlinks; l++)
+		j_first[l->a+1]++;
+	for (j = 0; j != n_junctions; j++)
+		j_first[j+1] += j_first[j];
+
+	n_j_edges = n_jlinks;
+	j_to = alloc_array(n_j_edges, sizeof(uint32_t));
+	j_len = alloc_array(n_j_edges, sizeof(uint16_t));
+	next = alloc_array(n_junctions, sizeof(uint32_t));
+	for (j = 0; j != n_junctions; j++)
+		next[j] = j_first[j];
+	for (l = jlinks; l != jlinks+n_jlinks; l++) {
+		j_to[next[l->a]] = l->b;
+		j_len[next[l->a]++] = short_len(l->len);
+	}
+	free(next);
+}
+
+
+/* what routing a previous graph left, see preview.c */
+
+static void release(void)
+{
+	free(junction);
+	free(node_chain);
+	free(node_pos);
+	free(j_node);
+	free(chains);
+	free(chain_nodes);
+	free(j_first);
+	free(j_to);
+	free(j_len);
+	free(j_distance);
+	free(j_nearest);
+	n_chains = n_chain_nodes = n_jlinks = 0;
+}
+
+
+static void contract(void)
+{
+	uint32_t n, j, shape = 0;
+
+	release();
+	junction = alloc_array(n_nodes, sizeof(uint32_t));
+	node_chain = alloc_array(n_nodes, sizeof(uint32_t));
+	node_pos = alloc_array(n_nodes, sizeof(uint32_t));
+
+	n_junctions = 0;
+	for (n = 0; n != n_nodes; n++) {
+		node_chain[n] = NONE;
+		junction[n] = NONE;
+		if (shape_point(n))
+			shape++;
+		else if (edge_first[n] != edge_first[n+1])
+			n_junctions++;
+	}
+
+	/*
+	 * A chain has at least one shape point, and each shape point is in
+	 * only one chain. Closed loops without any junction need one of their
+	 * shape points to be turned into a junction. Each chain adds at most
+	 * two junction edges, and junctions can be linked directly.
+	 */
+	j_node = alloc_array(n_junctions+shape, sizeof(uint32_t));
+	chains = alloc_array(shape, sizeof(struct chain));
+	chain_nodes = alloc_array(shape, sizeof(uint32_t));
+	jlinks = alloc_array(n_edges, sizeof(struct jlink));
+
+	n_junctions = 0;
+	for (n = 0; n != n_nodes; n++)
+		if (!shape_point(n) && edge_first[n] != edge_first[n+1])
+			add_junction(n);
+	for (j = 0; j != n_junctions; j++)
+		walk_junction(j);
+	for (n = 0; n != n_nodes; n++)
+		if (shape_point(n) && node_chain[n] == NONE)
+			walk_junction(add_junction(n));
+
+	make_j_edges();
+	free(jlinks);
+	jlinks = NULL;
+
+	j_distance = alloc_array(n_junctions, sizeof(uint16_t));
+	j_nearest = alloc_array(n_junctions, sizeof(int32_t));
+
+	fprintf(stderr, "%u junctions %u edges\n", n_junctions, n_j_edges);
+}
+
+
+/* ----- Routing ----------------------------------------------------------- */
+
+
+/*
+ * Ties between stations are broken in favour of the lower station number,
+ * so that the catchment of each station does not depend on routing order.
+ */
+
+static inline bool better(unsigned n, int d, int station)
+{
+	return d < node_distance[n] ||
+	    (d == node_distance[n] && station < node_nearest[n]);
+}
+
+
+static inline bool j_better(uint32_t j, int d, int station)
+{
+	return d < j_distance[j] ||
+	    (d == j_distance[j] && station < j_nearest[j]);
+}
+
+
+static void route(uint32_t j, int d, int station)
+{
+	uint32_t e;
+	int nd;
+
+	j_distance[j] = d;
+	j_nearest[j] = station;
+	for (e = j_first[j]; e != j_first[j+1]; e++) {
+		nd = d+j_len[e];
+		if (j_better(j_to[e], nd, station))
+			route(j_to[e], nd, station);
+	}
+}
+
+
+static void relax(uint32_t j, int d, int station)
+{
+	if (j_better(j, d, station))
+		route(j, d, station);
+}
+
+
+/*
+ * A station can capture a shape point. The shape point then keeps its
+ * distance as a lower bound for expand_distances, and we continue from both
+ * ends of its chain.
+ */
+
+static void capture(unsigned n, int d, int station)
+{
+	const struct chain *c;
+
+	if (junction[n] != NONE) {
+		relax(junction[n], d, station);
+		return;
+	}
+	if (!better(n, d, station))
+		return;
+	node_distance[n] = d;
+	node_nearest[n] = station;
+	if (node_chain[n] == NONE)
+		return;
+	c = chains+node_chain[n];
+	relax(c->a, d+node_pos[n], station);
+	relax(c->b, d+c->len-node_pos[n], station);
+}
+
+
+void prepare_routing(void)
+{
+	unsigned n;
+	uint32_t e;
+	double len;
+
+	for (n = 0; n != n_nodes; n++) {
+		node_distance[n] = UNREACHABLE;
+		node_nearest[n] = -1;
+		for (e = edge_first[n]; e != edge_first[n+1]; e++) {
+			len = hypot(node_x[n]-node_x[edge_to[e]],
+			    node_y[n]-node_y[edge_to[e]]);
+			len *= profile_cost(edge_class[e]);
+			edge_len[e] = short_len(len);
+		}
+	}
+
+	contract();
+	for (n = 0; n != n_junctions; n++) {
+		j_distance[n] = UNREACHABLE;
+		j_nearest[n] = -1;
+	}
+}
+
+
+unsigned count_routes(void)
+{
+	unsigned routes = 0;
+	unsigned n;
+
+	for (n = 0; n != n_nodes; n++)
+		if (eligible(n))
+			routes++;
+	return routes;
+}
+
+
+static int station_comp(const void *a, const void *b)
+{
+	int ia = node_id[*(const uint32_t *) a];
+	int ib = node_id[*(const uint32_t *) b];
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+
+uint32_t *station_nodes(void)
+{
+	uint32_t *nodes;
+	unsigned n, routes = 0;
+
+	nodes = alloc_array(count_routes(), sizeof(uint32_t));
+	for (n = 0; n != n_nodes; n++)
+		if (eligible(n))
+			nodes[routes++] = n;
+	qsort(nodes, routes, sizeof(uint32_t), station_comp);
+	return nodes;
+}
+
+
+static void find_distances_parallel(void);
+
+
+void find_distances(void)
+{
+	uint32_t *nodes;
+	unsigned n, m;
+	unsigned done, routes;
+	int d;
+
+	if (threads != 1) {
+		find_distances_parallel();
+		return;
+	}
+
+	routes = count_routes();
+	nodes = station_nodes();
+	for (done = 0; done != routes; done++) {
+		fprintf(stderr, "%u/%u\r", done, routes);
+		fflush(stderr);
+		n = nodes[done];
+		for (m = 0; m != n_nodes; m++) {
+			d = hypot(node_x[n]-node_x[m], node_y[n]-node_y[m]);
+			if (d <= NEAR)
+				capture(m, d, done);
+		}
+	}
+	free(nodes);
+}
+
+
+/* ----- Parallel routing (delta-stepping) -------------------------------- */
+
+
+/*
+ * All stations are routed at once. Junctions are kept in buckets of width
+ * DELTA by their tentative distance, and each bucket is processed by all
+ * threads together until it stays empty. Distance and station are packed
+ * into a single 64-bit label, so that a compare-and-swap loop can take the
+ * lexical minimum without locking. The result is the same as sequential
+ * routing, including the tie-breaking between stations.
+ */
+
+#define	DELTA		40	/* bucket width (m) */
+#define	BUCKETS		((UNREACHABLE+DELTA-1)/DELTA)
+#define	CHUNK		256	/* items a thread takes from the frontier */
+
+
+struct item {
+	uint32_t j;
+	uint64_t label;		/* label when queued, to skip stale items */
+};
+
+struct queue {
+	struct item *items;
+	uint32_t n, size;
+};
+
+struct seed {
+	uint32_t n;
+	uint16_t d;
+	int32_t station;
+};
+
+static struct worker {
+	struct queue bucket[BUCKETS];
+	struct seed *seeds;
+	uint32_t n_seeds, seeds_size;
+} *workers;
+
+static uint64_t *j_label;
+static uint32_t *stations;	/* station number -> node */
+static unsigned n_stations;
+
+static struct queue frontier;
+static uint32_t next_item;	/* next frontier item or station to take */
+static pthread_barrier_t barrier;
+
+
+static inline uint64_t make_label(int d, int station)
+{
+	return (uint64_t) d << 32 | (uint32_t) station;
+}
+
+
+static bool atomic_min(uint64_t *p, uint64_t label)
+{
+	uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	while (label < old)
+		if (__atomic_compare_exchange_n(p, &old, label, 1,
+		    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return 1;
+	return 0;
+}
+
+
+static void enqueue(struct queue *q, uint32_t j, uint64_t label)
+{
+	if (q->n == q->size) {
+		q->size = q->size ? 2*q->size : 1024;
+		q->items = realloc(q->items, sizeof(struct item)*q->size);
+		if (!q->items) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	q->items[q->n].j = j;
+	q->items[q->n].label = label;
+	q->n++;
+}
+
+
+static void p_relax(struct worker *w, uint32_t j, int d, int station)
+{
+	uint64_t label;
+
+	if (d >= UNREACHABLE)
+		return;
+	label = make_label(d, station);
+	if (atomic_min(j_label+j, label))
+		enqueue(w->bucket+d/DELTA, j, label);
+}
+
+
+static void add_seed(struct worker *w, uint32_t n, int d, int station)
+{
+	if (w->n_seeds == w->seeds_size) {
+		w->seeds_size = w->seeds_size ? 2*w->seeds_size : 1024;
+		w->seeds = realloc(w->seeds, sizeof(struct seed)*w->seeds_size);
+		if (!w->seeds) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	w->seeds[w->n_seeds].n = n;
+	w->seeds[w->n_seeds].d = d;
+	w->seeds[w->n_seeds].station = station;
+	w->n_seeds++;
+}
+
+
+/*
+ * Same as capture, but we put the junctions into the buckets instead of
+ * routing from them right away.
+ */
+
+static void p_capture(struct worker *w, const struct seed *s)
+{
+	const struct chain *c;
+	uint32_t n = s->n;
+
+	if (junction[n] != NONE) {
+		p_relax(w, junction[n], s->d, s->station);
+		return;
+	}
+	if (!better(n, s->d, s->station))
+		return;
+	node_distance[n] = s->d;
+	node_nearest[n] = s->station;
+	if (node_chain[n] == NONE)
+		return;
+	c = chains+node_chain[n];
+	p_relax(w, c->a, s->d+node_pos[n], s->station);
+	p_relax(w, c->b, s->d+c->len-node_pos[n], s->station);
+}
+
+
+static void find_seeds(void *user, unsigned thread)
+{
+	struct worker *w = workers+thread;
+	uint32_t station, n, m;
+	int d;
+
+	while (1) {
+		station = next_job(&next_item);
+		if (station >= n_stations)
+			break;
+		n = stations[station];
+		for (m = 0; m != n_nodes; m++) {
+			d = hypot(node_x[n]-node_x[m], node_y[n]-node_y[m]);
+			if (d <= NEAR)
+				add_seed(w, m, d, station);
+		}
+	}
+}
+
+
+/*
+ * Each thread moves its own part of bucket "b" to the frontier. The offsets
+ * only need the sizes of the parts, so every thread computes them for itself
+ * and thread 0 just makes room. The copying then runs in parallel.
+ */
+
+static uint32_t gather_offset(const struct worker *self, unsigned b)
+{
+	const struct worker *w;
+	uint32_t n = 0;
+
+	for (w = workers; w != self; w++)
+		n += w->bucket[b].n;
+	return n;
+}
+
+
+static void make_room(uint32_t n)
+{
+	if (n <= frontier.size)
+		return;
+	while (frontier.size < n)
+		frontier.size = frontier.size ? 2*frontier.size : 1024;
+	free(frontier.items);
+	frontier.items = alloc_array(frontier.size, sizeof(struct item));
+}
+
+
+static void process(struct worker *w)
+{
+	const struct item *it, *end;
+	uint32_t i, e;
+	int d, station;
+
+	while (1) {
+		i = __atomic_fetch_add(&next_item, CHUNK, __ATOMIC_RELAXED);
+		if (i >= frontier.n)
+			break;
+		end = frontier.items+(i+CHUNK < frontier.n ?
+		    i+CHUNK : frontier.n);
+		for (it = frontier.items+i; it != end; it++) {
+			if (__atomic_load_n(j_label+it->j, __ATOMIC_RELAXED) !=
+			    it->label)
+				continue;
+			d = it->label >> 32;
+			station = (int32_t) it->label;
+			for (e = j_first[it->j]; e != j_first[it->j+1]; e++)
+				p_relax(w, j_to[e], d+j_len[e], station);
+		}
+	}
+}
+
+
+static void delta_step(void *user, unsigned thread)
+{
+	struct worker *w = workers+thread;
+	struct queue *q;
+	uint32_t offset, total;
+	unsigned b;
+
+	for (b = 0; b != BUCKETS; b++)
+		while (1) {
+			pthread_barrier_wait(&barrier);
+			q = w->bucket+b;
+			offset = gather_offset(w, b);
+			total = gather_offset(workers+threads, b);
+			if (w == workers) {
+				make_room(total);
+				frontier.n = total;
+				next_item = 0;
+			}
+			pthread_barrier_wait(&barrier);
+			if (q->n)
+				memcpy(frontier.items+offset, q->items,
+				    sizeof(struct item)*q->n);
+			q->n = 0;
+			pthread_barrier_wait(&barrier);
+			if (!total)
+				break;
+			process(w);
+		}
+}
+
+
+static void find_distances_parallel(void)
+{
+	const struct worker *w;
+	const struct seed *s;
+	uint32_t j;
+
+	fprintf(stderr, "%u threads\n", threads);
+
+	workers = calloc(threads, sizeof(struct worker));
+	j_label = alloc_array(n_junctions, sizeof(uint64_t));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+
+	n_stations = count_routes();
+	stations = station_nodes();
+	for (j = 0; j != n_junctions; j++)
+		j_label[j] = make_label(UNREACHABLE, -1);
+
+	next_item = 0;
+	parallel(find_seeds, NULL);
+
+	/*
+	 * Shape points captured by more than one station need the tie-breaking
+	 * of "better", so we apply the seeds in a single thread. There are
+	 * only few of them, compared to the nodes we'll visit when routing.
+	 */
+	for (w = workers; w != workers+threads; w++)
+		for (s = w->seeds; s != w->seeds+w->n_seeds; s++)
+			p_capture(workers, s);
+
+	pthread_barrier_init(&barrier, NULL, threads);
+	parallel(delta_step, NULL);
+	pthread_barrier_destroy(&barrier);
+
+	for (j = 0; j != n_junctions; j++) {
+		j_distance[j] = j_label[j] >> 32;
+		j_nearest[j] = (int32_t) j_label[j];
+	}
+
+	for (w = workers; w != workers+threads; w++) {
+		for (j = 0; j != BUCKETS; j++)
+			free(w->bucket[j].items);
+		free(w->seeds);
+	}
+	free(workers);
+	free(j_label);
+	free(stations);
+	free(frontier.items);
+	frontier.items = NULL;
+	frontier.size = 0;
+}
+
+
+/* ----- Expansion --------------------------------------------------------- */
+
+
+/*
+ * Walk along the chain in both directions, and keep whichever is better:
+ * what we bring from the junction (or the previous shape point), or what the
+ * shape point got when it was captured.
+ */
+
+static void expand_chain(const struct chain *c)
+{
+	const uint32_t *p;
+	uint32_t last;
+	int d, station;
+
+	d = j_distance[c->a];
+	station = j_nearest[c->a];
+	last = 0;
+	for (p = chain_nodes+c->first; p != chain_nodes+c->first+c->n; p++) {
+		d += node_pos[*p]-last;
+		last = node_pos[*p];
+		if (better(*p, d, station)) {
+			node_distance[*p] = d;
+			node_nearest[*p] = station;
+		} else {
+			d = node_distance[*p];
+			station = node_nearest[*p];
+		}
+	}
+
+	d = j_distance[c->b];
+	station = j_nearest[c->b];
+	last = c->len;
+	for (p = chain_nodes+c->first+c->n; p != chain_nodes+c->first; ) {
+		p--;
+		d += last-node_pos[*p];
+		last = node_pos[*p];
+		if (better(*p, d, station)) {
+			node_distance[*p] = d;
+			node_nearest[*p] = station;
+		} else {
+			d = node_distance[*p];
+			station = node_nearest[*p];
+		}
+	}
+}
+
+
+void expand_distances(void)
+{
+	const struct chain *c;
+	uint32_t j;
+
+	for (j = 0; j != n_junctions; j++) {
+		node_distance[j_node[j]] = j_distance[j];
+		node_nearest[j_node[j]] = j_nearest[j];
+	}
+	for (c = chains; c != chains+n_chains; c++)
+		expand_chain(c);
+}
@@ -0,0 +1,72 @@
+/*
+ * route.h - Walking distance to the nearest station
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef ROUTE_H
+#define	ROUTE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "db.h"
+
+
+#define	UNREACHABLE	1000		/* 1 km out */
+#define	NEAR		80		/* station "capture" radius, 50 m */
+
+
+extern bool allow_proposed;
+
+
+static inline bool eligible(unsigned n)
+{
+	if (!(node_flags[n] & NODE_STATION))
+		return 0;
+	return allow_proposed || !(node_flags[n] & NODE_PROPOSED);
+}
+
+
+/*
+ * A shape point has exactly two neighbours and is not a station. Routing
+ * contracts chains of shape points between junctions, and the simplified
+ * output simplifies them.
+ */
+
+static inline bool shape_point(unsigned n)
+{
+	uint32_t e = edge_first[n];
+
+	if (node_flags[n] & NODE_STATION)
+		return 0;
+	if (edge_first[n+1]-e != 2)
+		return 0;
+	return edge_to[e] != n && edge_to[e+1] != n;
+}
+
+
+unsigned count_routes(void);
+
+/*
+ * Stations are numbered in the order of their node IDs, so that the
+ * tie-breaking between them does not depend on the order of the nodes.
+ * station_nodes returns a new array with the node of each station.
+ */
+
+uint32_t *station_nodes(void);
+
+void prepare_routing(void);
+void find_distances(void);
+
+/*
+ * Routing only sets the distances of junctions. expand_distances fills in
+ * the nodes along the chains between them.
+ */
+
+void expand_distances(void);
+
+#endif /* ROUTE_H */
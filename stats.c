@@ -0,0 +1,196 @@
+/*
+ * stats.c - Coverage statistics
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+
+#define	HIST_BINS	(BAND_BAD/HIST_BIN)
+
+
+struct catchment {
+	int id;
+	int x, y;
+	double band[bands];
+};
+
+
+static double hist[HIST_BINS+1];	/* last bin is "remote" */
+static double total[bands];
+static double unserved;			/* no station in reach at all */
+static struct catchment *catchments;
+static unsigned n_catchments;
+
+
+static const char *band_name[] = {
+	[band_good]	= "good",
+	[band_average]	= "average",
+	[band_bad]	= "bad",
+	[band_remote]	= "remote",
+};
+
+
+/* ----- Accumulation ------------------------------------------------------ */
+
+
+static double overlap(double a0, double a1, double b0, double b1)
+{
+	double lo = a0 > b0 ? a0 : b0;
+	double hi = a1 < b1 ? a1 : b1;
+
+	return hi > lo ? hi-lo : 0;
+}
+
+
+/*
+ * Walking away from a node at distance "d", the distance grows by one meter
+ * per meter. A span of length "len" thus covers distances d ... d+len, and we
+ * can split it exactly at the band and bin boundaries. "scale" converts from
+ * routing length to actual length.
+ */
+
+static void band_span(double *band, double d, double len, double scale)
+{
+	static const double limit[bands+1] =
+	    { 0, BAND_GOOD, BAND_AVERAGE, BAND_BAD, 1e30 };
+	unsigned i;
+
+	if (len <= 0)
+		return;
+	for (i = 0; i != bands; i++)
+		band[i] += overlap(d, d+len, limit[i], limit[i+1])*scale;
+}
+
+
+static void add_span(double d, double len, int station, double scale)
+{
+	struct catchment *c = station < 0 ? NULL : catchments+station;
+	double part[bands] = { 0 };
+	unsigned i;
+
+	if (len <= 0)
+		return;
+	band_span(part, d, len, scale);
+	for (i = 0; i != bands; i++) {
+		total[i] += part[i];
+		if (c)
+			c->band[i] += part[i];
+	}
+	for (i = 0; i != HIST_BINS; i++)
+		hist[i] +=
+		    overlap(d, d+len, i*HIST_BIN, (i+1)*HIST_BIN)*scale;
+	hist[HIST_BINS] += overlap(d, d+len, BAND_BAD, 1e30)*scale;
+	if (!c)
+		unserved += len*scale;
+}
+
+
+/*
+ * The distance along the segment is min(da+t, db+len-t), so the part up to
+ * the crossover point is served from "a", and the rest from "b".
+ */
+
+static double crossover(int da, int db, int len)
+{
+	double t;
+
+	t = (db+len-da)/2.0;
+	if (t < 0)
+		return 0;
+	if (t > len)
+		return len;
+	return t;
+}
+
+
+void stats_edge(int da, int sa, int db, int sb, int len, double weight)
+{
+	double scale = len ? weight/len : 0;
+	double t = crossover(da, db, len);
+
+	add_span(da, t, sa, scale);
+	add_span(db, len-t, sb, scale);
+}
+
+
+void stats_bands(double *band, int da, int db, int len, double scale)
+{
+	double t = crossover(da, db, len);
+
+	band_span(band, da, t, scale);
+	band_span(band, db, len-t, scale);
+}
+
+
+/* ----- Setup ------------------------------------------------------------- */
+
+
+void stats_init(unsigned stations)
+{
+	catchments = calloc(stations, sizeof(struct catchment));
+	if (stations && !catchments) {
+		perror("calloc");
+		exit(1);
+	}
+	n_catchments = stations;
+}
+
+
+void stats_station(unsigned station, int id, int x, int y)
+{
+	struct catchment *c = catchments+station;
+
+	c->id = id;
+	c->x = x;
+	c->y = y;
+}
+
+
+/* ----- Report ------------------------------------------------------------ */
+
+
+static double pct(double part, double whole)
+{
+	return whole ? part*100.0/whole : 0;
+}
+
+
+void stats_report(FILE *file)
+{
+	const struct catchment *c;
+	double sum = 0, cum = 0;
+	unsigned i;
+
+	for (i = 0; i != bands; i++)
+		sum += total[i];
+
+	fprintf(file, "# total road length %.0f m, %.0f m unserved\n",
+	    sum, unserved);
+	fprintf(file, "# band length(m) percent\n");
+	for (i = 0; i != bands; i++)
+		fprintf(file, "%s %.0f %.2f\n",
+		    band_name[i], total[i], pct(total[i], sum));
+
+	fprintf(file, "\n# from(m) length(m) percent cumulative\n");
+	for (i = 0; i != HIST_BINS+1; i++) {
+		cum += hist[i];
+		fprintf(file, "%d %.0f %.2f %.2f\n",
+		    i*HIST_BIN, hist[i], pct(hist[i], sum), pct(cum, sum));
+	}
+
+	fprintf(file, "\n# station x y good(m) average(m) bad(m) remote(m)\n");
+	for (c = catchments; c != catchments+n_catchments; c++)
+		fprintf(file, "%d %d %d %.0f %.0f %.0f %.0f\n",
+		    c->id, c->x, c->y, c->band[band_good],
+		    c->band[band_average], c->band[band_bad],
+		    c->band[band_remote]);
+}
@@ -0,0 +1,68 @@
+/*
+ * stats.h - Coverage statistics
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef STATS_H
+#define	STATS_H
+
+#include <stdio.h>
+
+
+/* Distance bands, as used by "plot" and classify() in r/r.c */
+
+#define	BAND_GOOD	333
+#define	BAND_AVERAGE	666
+#define	BAND_BAD	1000	/* beyond this, we're "remote" */
+
+#define	HIST_BIN	50	/* histogram bin width (m) */
+
+
+enum band {
+	band_good,
+	band_average,
+	band_bad,
+	band_remote,
+	bands
+};
+
+
+static inline enum band classify(int d)
+{
+	if (d <= BAND_GOOD)
+		return band_good;
+	if (d <= BAND_AVERAGE)
+		return band_average;
+	if (d < BAND_BAD)
+		return band_bad;
+	return band_remote;
+}
+
+
+void stats_init(unsigned stations);
+void stats_station(unsigned station, int id, int x, int y);
+
+/*
+ * Account for a road segment between two nodes at distance "da" and "db" from
+ * their nearest station, "sa" and "sb". A station number of -1 means that no
+ * station is within reach. "len" is the segment's length for routing, and
+ * "weight" its actual length.
+ */
+
+void stats_edge(int da, int sa, int db, int sb, int len, double weight);
+
+/*
+ * Add the length of the segment in each band to band[bands], split like
+ * stats_edge does, but without accumulating anything. "scale" converts from
+ * routing length to actual length.
+ */
+
+void stats_bands(double *band, int da, int db, int len, double scale);
+
+void stats_report(FILE *file);
+
+#endif /* STATS_H */
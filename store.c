@@ -0,0 +1,524 @@
+/*
+ * store.c - Graph store, tiled by longitude and latitude
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "util.h"
+#include "local.h"
+#include "clip.h"
+#include "db.h"
+#include "store.h"
+
+
+#define	ALIGN	8	/* alignment of tile data and lines */
+
+
+static struct store_header header;
+static struct store_tile *tiles;
+
+
+/* rounds towards minus infinity, also for negative coordinates */
+
+static int32_t floor_div(int64_t a, int32_t b)
+{
+	return a >= 0 ? a/b : -((-a+b-1)/b);
+}
+
+
+static uint64_t align(uint64_t offset)
+{
+	return (offset+ALIGN-1) & ~(uint64_t) (ALIGN-1);
+}
+
+
+/* ----- Writing ----------------------------------------------------------- */
+
+
+static FILE *file;
+static const char *file_name;
+
+static struct store_ref *refs;	/* node -> tile and index within tile */
+static uint32_t *tile_first;	/* nodes of each tile, as CSR */
+static uint32_t *tile_nodes;
+
+
+static void write_all(const void *buf, size_t len)
+{
+	if (len && fwrite(buf, len, 1, file) != 1) {
+		perror(file_name);
+		exit(1);
+	}
+}
+
+
+static void pad_to(uint64_t offset)
+{
+	static const uint8_t zero[ALIGN] = { 0 };
+	long pos = ftell(file);
+
+	write_all(zero, offset-pos);
+}
+
+
+static void bounds(void)
+{
+	int32_t lon_lo, lon_hi, lat_lo, lat_hi;
+
+	node_extent(&lon_lo, &lon_hi, &lat_lo, &lat_hi);
+
+	/* tiles are on a global grid, so stores of nearby areas line up */
+	header.size = STORE_TILE;
+	header.lon0 = floor_div(lon_lo, STORE_TILE)*STORE_TILE;
+	header.lat0 = floor_div(lat_lo, STORE_TILE)*STORE_TILE;
+	header.cols = n_nodes ?
+	    floor_div((int64_t) lon_hi-header.lon0, STORE_TILE)+1 : 0;
+	header.rows = n_nodes ?
+	    floor_div((int64_t) lat_hi-header.lat0, STORE_TILE)+1 : 0;
+}
+
+
+/* nodes stay in their order within each tile */
+
+static void assign_tiles(void)
+{
+	uint32_t n_tiles = header.cols*header.rows;
+	uint32_t *next;
+	uint32_t t, n;
+
+	refs = alloc_array(n_nodes, sizeof(struct store_ref));
+	tile_first = calloc(n_tiles+1, sizeof(uint32_t));
+	if (!tile_first) {
+		perror("calloc");
+		exit(1);
+	}
+	for (n = 0; n != n_nodes; n++) {
+		refs[n].tile =
+		    floor_div((int64_t) node_lat[n]-header.lat0, STORE_TILE)*
+		    header.cols +
+		    floor_div((int64_t) node_lon[n]-header.lon0, STORE_TILE);
+		tile_first[refs[n].tile+1]++;
+	}
+	for (t = 0; t != n_tiles; t++)
+		tile_first[t+1] += tile_first[t];
+
+	tile_nodes = alloc_array(n_nodes, sizeof(uint32_t));
+	next = alloc_array(n_tiles, sizeof(uint32_t));
+	memcpy(next, tile_first, sizeof(uint32_t)*n_tiles);
+	for (n = 0; n != n_nodes; n++) {
+		refs[n].node = next[refs[n].tile]-tile_first[refs[n].tile];
+		tile_nodes[next[refs[n].tile]++] = n;
+	}
+	free(next);
+}
+
+
+static void write_tile(uint32_t t)
+{
+	struct store_node sn;
+	struct store_edge se;
+	uint32_t i, n, e, first = 0;
+
+	memset(&sn, 0, sizeof(sn));
+	for (i = tile_first[t]; i != tile_first[t+1]; i++) {
+		n = tile_nodes[i];
+		sn.id = node_id[n];
+		sn.lat = node_lat[n];
+		sn.lon = node_lon[n];
+		sn.first = first;
+		sn.flags = node_flags[n] & (NODE_STATION | NODE_PROPOSED);
+		write_all(&sn, sizeof(sn));
+		first += edge_first[n+1]-edge_first[n];
+	}
+
+	memset(&se, 0, sizeof(se));
+	for (i = tile_first[t]; i != tile_first[t+1]; i++) {
+		n = tile_nodes[i];
+		for (e = edge_first[n]; e != edge_first[n+1]; e++) {
+			se.to = refs[edge_to[e]];
+			se.cls = edge_class[e];
+			se.access = edge_access[e];
+			se.foot = edge_foot[e];
+			write_all(&se, sizeof(se));
+		}
+	}
+}
+
+
+static void write_lines(void)
+{
+	const struct line *l;
+	struct store_line sl;
+	uint32_t i, ref = 0;
+
+	for (l = lines; l != lines+n_lines; l++) {
+		sl.first = l->first;
+		sl.n = l->n;
+		sl.ref = l->ref ? ref : STORE_NONE;
+		if (l->ref)
+			ref += strlen(l->ref)+1;
+		write_all(&sl, sizeof(sl));
+	}
+	for (i = 0; i != n_line_stops; i++)
+		write_all(refs+line_stops[i], sizeof(struct store_ref));
+	for (l = lines; l != lines+n_lines; l++)
+		if (l->ref)
+			write_all(l->ref, strlen(l->ref)+1);
+}
+
+
+void write_store(const char *name)
+{
+	const struct line *l;
+	uint32_t t, n, n_tiles;
+	uint64_t offset;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+	bounds();
+	n_tiles = header.cols*header.rows;
+	assign_tiles();
+
+	tiles = calloc(n_tiles, sizeof(struct store_tile));
+	if (n_tiles && !tiles) {
+		perror("calloc");
+		exit(1);
+	}
+	offset = align(sizeof(header)+sizeof(struct store_tile)*n_tiles);
+	for (t = 0; t != n_tiles; t++) {
+		tiles[t].offset = offset;
+		tiles[t].n_nodes = tile_first[t+1]-tile_first[t];
+		tiles[t].n_edges = 0;
+		for (n = tile_first[t]; n != tile_first[t+1]; n++)
+			tiles[t].n_edges += edge_first[tile_nodes[n]+1]-
+			    edge_first[tile_nodes[n]];
+		offset = align(offset+
+		    sizeof(struct store_node)*tiles[t].n_nodes+
+		    sizeof(struct store_edge)*tiles[t].n_edges);
+	}
+	header.lines = offset;
+	header.n_lines = n_lines;
+	header.n_stops = n_line_stops;
+	for (l = lines; l != lines+n_lines; l++)
+		if (l->ref)
+			header.refs += strlen(l->ref)+1;
+
+	file_name = name;
+	file = fopen(name, "w");
+	if (!file) {
+		perror(name);
+		exit(1);
+	}
+	write_all(&header, sizeof(header));
+	write_all(tiles, sizeof(struct store_tile)*n_tiles);
+	for (t = 0; t != n_tiles; t++) {
+		pad_to(tiles[t].offset);
+		write_tile(t);
+	}
+	pad_to(header.lines);
+	write_lines();
+	if (fclose(file) == EOF) {
+		perror(name);
+		exit(1);
+	}
+
+	fprintf(stderr, "%u tiles, %llu bytes\n", n_tiles,
+	    (unsigned long long) header.lines+
+	    sizeof(struct store_line)*n_lines+
+	    sizeof(struct store_ref)*n_line_stops+header.refs);
+
+	free(tiles);
+	free(refs);
+	free(tile_first);
+	free(tile_nodes);
+}
+
+
+/* ----- Reading ----------------------------------------------------------- */
+
+
+/*
+ * The whole file is mapped, but we only touch the pages of the tiles we
+ * need. Each tile we read gets a map from its node indices to our node
+ * numbers, so that edges into other tiles can be stitched back together.
+ */
+
+static const uint8_t *base;
+static size_t base_size;
+static const char *store_name;
+
+static uint32_t **node_map;	/* per tile, NULL if not read */
+
+
+static const void *at(uint64_t offset, uint64_t len)
+{
+	if (offset > base_size || len > base_size-offset) {
+		fprintf(stderr, "%s: file is truncated\n", store_name);
+		exit(1);
+	}
+	return base+offset;
+}
+
+
+static bool inside(const struct store_node *sn)
+{
+	double lat = sn->lat/1e7;
+	double lon = sn->lon/1e7;
+
+	return lon >= lon_min && lon <= lon_max &&
+	    lat >= lat_min && lat <= lat_max &&
+	    (!clipping || clip_inside(lat, lon));
+}
+
+
+/* tiles that intersect [lo, hi] on one axis */
+
+static bool tile_range(double lo, double hi, int32_t origin, uint32_t n,
+    uint32_t *from, uint32_t *to)
+{
+	int64_t a, b;
+
+	a = floor_div((int64_t) (lo*1e7)-origin-1, header.size);
+	b = floor_div((int64_t) (hi*1e7)-origin+1, header.size);
+	if (b < 0 || a >= (int64_t) n)
+		return 0;
+	*from = a < 0 ? 0 : a;
+	*to = b >= (int64_t) n ? n-1 : b;
+	return 1;
+}
+
+
+static void map_tile(uint32_t t)
+{
+	const struct store_node *sn;
+	uint32_t i;
+
+	sn = at(tiles[t].offset, sizeof(struct store_node)*tiles[t].n_nodes);
+	node_map[t] = alloc_array(tiles[t].n_nodes, sizeof(uint32_t));
+	for (i = 0; i != tiles[t].n_nodes; i++)
+		node_map[t][i] = inside(sn+i) ? n_nodes++ : STORE_NONE;
+}
+
+
+static void read_nodes(uint32_t t)
+{
+	const struct store_node *sn;
+	uint32_t i, n;
+
+	sn = at(tiles[t].offset, sizeof(struct store_node)*tiles[t].n_nodes);
+	for (i = 0; i != tiles[t].n_nodes; i++) {
+		n = node_map[t][i];
+		if (n == STORE_NONE)
+			continue;
+		node_id[n] = sn[i].id;
+		node_lat[n] = sn[i].lat;
+		node_lon[n] = sn[i].lon;
+		node_flags[n] = sn[i].flags;
+		map_point(sn[i].lat/1e7, sn[i].lon/1e7, node_x+n, node_y+n);
+	}
+}
+
+
+static uint32_t resolve(const struct store_ref *r)
+{
+	uint32_t n_tiles = header.cols*header.rows;
+
+	if (r->tile >= n_tiles || !node_map[r->tile])
+		return STORE_NONE;
+	if (r->node >= tiles[r->tile].n_nodes) {
+		fprintf(stderr, "%s: bad node reference\n", store_name);
+		exit(1);
+	}
+	return node_map[r->tile][r->node];
+}
+
+
+static void read_edges(uint32_t t)
+{
+	const struct store_node *sn;
+	const struct store_edge *se;
+	uint32_t i, e, end, a, b;
+
+	sn = at(tiles[t].offset, sizeof(struct store_node)*tiles[t].n_nodes);
+	se = at(tiles[t].offset+sizeof(struct store_node)*tiles[t].n_nodes,
+	    sizeof(struct store_edge)*tiles[t].n_edges);
+	for (i = 0; i != tiles[t].n_nodes; i++) {
+		a = node_map[t][i];
+		if (a == STORE_NONE)
+			continue;
+		end = i+1 == tiles[t].n_nodes ?
+		    tiles[t].n_edges : sn[i+1].first;
+		for (e = sn[i].first; e != end && e < tiles[t].n_edges; e++) {
+			b = resolve(&se[e].to);
+			if (b != STORE_NONE)
+				link_nodes(a, b, se[e].cls, se[e].access,
+				    se[e].foot);
+		}
+	}
+}
+
+
+/* like resolve_lines in db.c, lines with fewer than two stops are dropped */
+
+static void read_lines(void)
+{
+	const struct store_line *sl;
+	const struct store_ref *stops;
+	const char *ref;
+	uint32_t i, j, n, first;
+
+	sl = at(header.lines, sizeof(struct store_line)*header.n_lines);
+	stops = at(header.lines+sizeof(struct store_line)*header.n_lines,
+	    sizeof(struct store_ref)*header.n_stops);
+	ref = at(header.lines+sizeof(struct store_line)*header.n_lines+
+	    sizeof(struct store_ref)*header.n_stops, header.refs);
+
+	lines = alloc_array(header.n_lines, sizeof(struct line));
+	line_stops = alloc_array(header.n_stops, sizeof(uint32_t));
+	n_lines = n_line_stops = 0;
+	for (i = 0; i != header.n_lines; i++) {
+		if (sl[i].first > header.n_stops ||
+		    sl[i].n > header.n_stops-sl[i].first ||
+		    (sl[i].ref != STORE_NONE && sl[i].ref >= header.refs)) {
+			fprintf(stderr, "%s: bad line\n", store_name);
+			exit(1);
+		}
+		first = n_line_stops;
+		for (j = sl[i].first; j != sl[i].first+sl[i].n; j++) {
+			n = resolve(stops+j);
+			if (n != STORE_NONE)
+				line_stops[n_line_stops++] = n;
+		}
+		if (n_line_stops-first < 2) {
+			n_line_stops = first;
+			continue;
+		}
+		lines[n_lines].ref = NULL;
+		if (sl[i].ref != STORE_NONE) {
+			lines[n_lines].ref = strndup(ref+sl[i].ref,
+			    header.refs-sl[i].ref);
+			if (!lines[n_lines].ref) {
+				perror("strndup");
+				exit(1);
+			}
+		}
+		lines[n_lines].first = first;
+		lines[n_lines].n = n_line_stops-first;
+		n_lines++;
+	}
+}
+
+
+/* any version, so that read_store can tell about old ones */
+
+bool is_store(const char *name)
+{
+	char magic[sizeof(header.magic)];
+	FILE *file;
+	bool res;
+
+	file = fopen(name, "r");
+	if (!file)
+		return 0;
+	res = fread(magic, sizeof(magic), 1, file) == 1 &&
+	    !memcmp(magic, STORE_MAGIC, sizeof(magic)-1);
+	fclose(file);
+	return res;
+}
+
+
+void read_store(const char *name)
+{
+	struct stat st;
+	uint32_t c0, c1, r0, r1, c, r, t, n_tiles;
+	unsigned used = 0;
+	int fd;
+
+	store_name = name;
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		perror(name);
+		exit(1);
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		exit(1);
+	}
+	base_size = st.st_size;
+	base = mmap(NULL, base_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+
+	header = *(const struct store_header *) at(0, sizeof(header));
+	if (memcmp(header.magic, STORE_MAGIC, sizeof(header.magic))) {
+		fprintf(stderr, "%s: old format, please write the store "
+		    "again\n", name);
+		exit(1);
+	}
+	n_tiles = header.cols*header.rows;
+	if (!header.size ||
+	    (header.cols && n_tiles/header.cols != header.rows)) {
+		fprintf(stderr, "%s: bad header\n", name);
+		exit(1);
+	}
+	tiles = (struct store_tile *) at(sizeof(header),
+	    sizeof(struct store_tile)*(uint64_t) n_tiles);
+
+	node_map = calloc(n_tiles, sizeof(uint32_t *));
+	if (n_tiles && !node_map) {
+		perror("calloc");
+		exit(1);
+	}
+
+	/*
+	 * Ranges are widened by one unit, so that rounding cannot lose a
+	 * node on a tile border. Nodes outside the box are dropped anyway.
+	 */
+	n_nodes = 0;
+	if (tile_range(lon_min, lon_max, header.lon0, header.cols, &c0, &c1) &&
+	    tile_range(lat_min, lat_max, header.lat0, header.rows, &r0, &r1))
+		for (r = r0; r <= r1; r++)
+			for (c = c0; c <= c1; c++) {
+				map_tile(r*header.cols+c);
+				used++;
+			}
+
+	node_id = alloc_array(n_nodes, sizeof(int));
+	node_x = alloc_array(n_nodes, sizeof(int));
+	node_y = alloc_array(n_nodes, sizeof(int));
+	node_lat = alloc_array(n_nodes, sizeof(int32_t));
+	node_lon = alloc_array(n_nodes, sizeof(int32_t));
+	node_flags = alloc_array(n_nodes, 1);
+	for (t = 0; t != n_tiles; t++)
+		if (node_map[t])
+			read_nodes(t);
+	for (t = 0; t != n_tiles; t++)
+		if (node_map[t])
+			read_edges(t);
+	read_lines();
+
+	for (t = 0; t != n_tiles; t++)
+		free(node_map[t]);
+	free(node_map);
+	munmap((void *) base, base_size);
+
+	fprintf(stderr, "%u of %u tiles\n", used, n_tiles);
+	build_graph();
+}
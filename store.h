@@ -0,0 +1,100 @@
+/*
+ * store.h - Graph store, tiled by longitude and latitude
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef STORE_H
+#define	STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/*
+ * File layout, all in host byte order:
+ *
+ *   struct store_header
+ *   struct store_tile [rows][cols]	row 0 is at the bottom (smallest lat)
+ *   tile data, in the same order as the entries
+ *   struct store_line [n_lines]
+ *   struct store_ref [n_stops]		stops of all lines
+ *   char [refs]			"ref" tags, each with a trailing NUL
+ *
+ * The data of a tile are its nodes, followed by their edges. Each node keeps
+ * the index of its first edge, and the edges of a node end where the edges of
+ * the next one begin. Edges, including those that cross into another tile,
+ * point to their node by tile and index within that tile. The edges of both
+ * directions are stored, each with the node it starts from.
+ *
+ * Coordinates are in 1e-7 degrees, as in OSM, so that each new bounding box
+ * can be projected exactly as if the map had been read from OSM XML.
+ */
+
+#define	STORE_MAGIC	"SUBOSMG2"
+#define	STORE_TILE	100000		/* tile size, 0.01 degrees */
+#define	STORE_NONE	UINT32_MAX
+
+
+struct store_header {
+	char magic[8];
+	int32_t lon0, lat0;	/* lower left corner of tile 0 */
+	uint32_t size;		/* width and height of a tile */
+	uint32_t cols, rows;
+	uint32_t n_lines, n_stops;
+	uint32_t refs;		/* bytes */
+	uint64_t lines;		/* offset of the lines */
+};
+
+struct store_tile {
+	uint64_t offset;	/* from the beginning of the file */
+	uint32_t n_nodes, n_edges;
+};
+
+struct store_node {
+	int32_t id;
+	int32_t lat, lon;
+	uint32_t first;		/* first edge in the tile */
+	uint8_t flags;
+	uint8_t pad[3];
+};
+
+struct store_ref {
+	uint32_t tile;		/* [row][col] -> row*cols+col */
+	uint32_t node;		/* within the tile */
+};
+
+struct store_edge {
+	struct store_ref to;
+	uint8_t cls;		/* highway=... (enum token) */
+	uint8_t access;		/* access=... */
+	uint8_t foot;		/* foot=... */
+	uint8_t pad;
+};
+
+struct store_line {
+	uint32_t first, n;	/* in the stops */
+	uint32_t ref;		/* offset in the refs, STORE_NONE if none */
+};
+
+
+/*
+ * write_store writes the graph as build_graph leaves it, i.e., all highways
+ * with their access and foot tags, before the walking profile, the merging
+ * of parallel edges, and prune_nets. A store can thus be read with any of
+ * them, and finish_graph applies them as for OSM XML.
+ *
+ * read_store maps a store, and only reads the tiles that intersect the
+ * bounding box. Of those, it keeps the nodes inside the box, and the edges
+ * between them. Like "-M", it does not link the nodes on both sides of a gap
+ * where a way leaves the box.
+ */
+
+bool is_store(const char *name);
+void write_store(const char *name);
+void read_store(const char *name);
+
+#endif /* STORE_H */
@@ -10,6 +10,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -20,138 +21,247 @@
 #include <sys/mman.h>
 
 #include "local.h"
+#include "clip.h"
+#include "profile.h"
 #include "db.h"
+#include "parallel.h"
+#include "route.h"
+#include "stats.h"
+#include "lod.h"
+#include "tile.h"
+#include "matrix.h"
+#include "closure.h"
+#include "contour.h"
+#include "travel.h"
+#include "raster.h"
+#include "store.h"
+#include "preview.h"
+#include "population.h"
 
 
 double lon_min, lon_max, lat_min, lat_max;
 
-static bool allow_proposed = 0;
+static bool want_stats = 0;
 
+static struct lod {
+	double tolerance;
+	const char *name;
+	struct lod *next;
+} *lods = NULL, **last_lod = &lods;
 
-/* ----- Distance calculation ---------------------------------------------- */
 
-
-#define	UNREACHABLE	1000		/* 1 km out */
-#define	NEAR		80		/* station "capture" radius, 50 m */
+/* ----- Dumping ----------------------------------------------------------- */
 
 
-static void route(struct node *n, int d)
+static void recurse(unsigned n)
 {
-	struct edge *e;
-	int nd;
+	uint32_t e;
+	unsigned m;
 
-	n->distance = d;
-	for (e = n->edges; e != n->edges+n->n_edges; e++) {
-		nd = d+e->len;
-		if (e->n->distance > nd)
-			route(e->n, nd);
+	node_flags[n] |= NODE_TAG;
+	for (e = edge_first[n]; e != edge_first[n+1]; e++) {
+		m = edge_to[e];
+		if (node_id[m] > node_id[n]) {
+			printf("%d %d %d # %d\n%d %d %d # %d\n\n",
+			    node_x[n], node_y[n], node_distance[n], node_id[n],
+			    node_x[m], node_y[m], node_distance[n], node_id[m]);
+			if (want_stats)
+				stats_edge(node_distance[n], node_nearest[n],
+				    node_distance[m], node_nearest[m],
+				    edge_len[e],
+				    edge_len[e]/profile_cost(edge_class[e]));
+		}
+		if (!(node_flags[m] & NODE_TAG))
+			recurse(m);
 	}
 }
 
 
-static void prepare_routing(void)
+static void reset_tags(void)
 {
-	struct node *n;
-	struct edge *e;
+	unsigned n;
 
-	for (n = nodes; n != nodes+n_nodes; n++) {
-		n->distance = UNREACHABLE;
-		for (e = n->edges; e != n->edges+n->n_edges; e++)
-			e->len = hypot(n->x-e->n->x, n->y-e->n->y);
-	}
+	for (n = 0; n != n_nodes; n++)
+		node_flags[n] &= ~NODE_TAG;
 }
 
 
-static unsigned count_routes(void)
+static void dump_db(void)
 {
-	unsigned routes = 0;
-
-	struct node *n;
+	unsigned n;
 
-	for (n = nodes; n != nodes+n_nodes; n++) {
-		if (!n->station)
+	expand_distances();
+	reset_tags();
+	for (n = 0; n != n_nodes; n++) {
+		if (eligible(n))
+			printf("#STATION %d %d %d # %d\n",
+			    node_x[n], node_y[n], node_distance[n], node_id[n]);
+		if (node_flags[n] & NODE_TAG)
 			continue;
-		if (n->proposed && !allow_proposed)
+		if (edge_first[n] == edge_first[n+1])
 			continue;
-		routes++;
+		if (n)
+			printf("# new net\n\n");
+		recurse(n);
 	}
-	return routes;
 }
 
 
-static void find_distances(void)
+/*
+ * The segments only carry the distance of their first node, so a node that
+ * only ends segments has no distance in the output. The node table has them
+ * all. Call after dump_db, which expands the distances.
+ */
+
+static void dump_nodes(FILE *file)
 {
-	struct node *n, *m;
-	unsigned done = 0, routes;
-	int d;
+	unsigned n;
 
-	routes = count_routes();
-	for (n = nodes; n != nodes+n_nodes; n++) {
-		fprintf(stderr, "%u/%u\r", done, routes);
-		fflush(stderr);
-		if (!n->station)
-			continue;
-		if (n->proposed && !allow_proposed)
-			continue;
-		for (m = nodes; m != nodes+n_nodes; m++) {
-			d = hypot(n->x-m->x, n->y-m->y);
-			if (d <= NEAR && d < m->distance)
-				route(m, d);
+	fprintf(file, "# id x y d\n");
+	for (n = 0; n != n_nodes; n++)
+		if (edge_first[n] != edge_first[n+1] || eligible(n))
+			fprintf(file, "%d %d %d %d\n", node_id[n],
+			    node_x[n], node_y[n], node_distance[n]);
+}
+
+
+/* ----- Simplified output ------------------------------------------------ */
+
+
+static void add_lod(const char *arg)
+{
+	struct lod *lod;
+	char *end;
+
+	lod = malloc(sizeof(struct lod));
+	if (!lod) {
+		perror("malloc");
+		exit(1);
+	}
+	lod->tolerance = strtod(arg, &end);
+	if (end == arg || *end != ':' || !end[1]) {
+		fprintf(stderr, "expected tolerance:file, not \"%s\"\n", arg);
+		exit(1);
+	}
+	lod->name = end+1;
+	lod->next = NULL;
+	*last_lod = lod;
+	last_lod = &lod->next;
+}
+
+
+static void dump_lods(void)
+{
+	const struct lod *lod;
+	FILE *file;
+
+	for (lod = lods; lod; lod = lod->next) {
+		file = fopen(lod->name, "w");
+		if (!file) {
+			perror(lod->name);
+			exit(1);
+		}
+		dump_lod(file, lod->tolerance);
+		if (fclose(file) < 0) {
+			perror(lod->name);
+			exit(1);
 		}
-		done++;
 	}
 }
 
 
-/* ----- Dumping ----------------------------------------------------------- */
+/* ----- Statistics ------------------------------------------------------- */
 
 
-static void recurse(struct node *n)
+static void register_stations(void)
 {
-	struct edge *edge;
+	uint32_t *nodes;
+	unsigned station, routes, n;
 
-	n->tag = 1;
-	for (edge = n->edges; edge != n->edges+n->n_edges; edge++) {
-		if (!edge->tag && edge->n->id > n->id)
-			printf("%d %d %d # %d\n%d %d %d # %d\n\n",
-			    n->x, n->y, n->distance, n->id,
-			    edge->n->x, edge->n->y, n->distance, edge->n->id);
-		edge->tag = 1;
-		if (!edge->n->tag)
-			recurse(edge->n);
+	routes = count_routes();
+	nodes = station_nodes();
+	stats_init(routes);
+	for (station = 0; station != routes; station++) {
+		n = nodes[station];
+		stats_station(station, node_id[n], node_x[n], node_y[n]);
 	}
+	free(nodes);
 }
 
 
-static void reset_tags(void)
+/* ----- Travel times ------------------------------------------------------ */
+
+
+static void add_dest(const char *arg)
 {
-	struct node *n;
-	struct edge *e;
+	double lon, lat;
+	char *end;
 
-	for (n = nodes; n != nodes+n_nodes; n++) {
-		n->tag = 0;
-		for (e = n->edges; e != n->edges+n->n_edges; e++)
-			e->tag = 0;
+	lon = strtod(arg, &end);
+	if (end == arg || *end != ',') {
+		fprintf(stderr, "expected lon,lat, not \"%s\"\n", arg);
+		exit(1);
 	}
+	arg = end+1;
+	lat = strtod(arg, &end);
+	if (end == arg || *end) {
+		fprintf(stderr, "expected lon,lat, not \"%s\"\n", arg);
+		exit(1);
+	}
+	add_destination(lon, lat);
 }
 
 
-static void dump_db(void)
+static void add_speed(const char *arg)
 {
-	struct node *n;
+	const char *ref = NULL;
+	double speed, headway;
+	char *eq, *end;
+
+	eq = strchr(arg, '=');
+	if (eq) {
+		ref = strndup(arg, eq-arg);
+		if (!ref) {
+			perror("strndup");
+			exit(1);
+		}
+		arg = eq+1;
+	}
+	speed = strtod(arg, &end);
+	if (end == arg || *end != ':' || speed <= 0)
+		goto fail;
+	arg = end+1;
+	headway = strtod(arg, &end);
+	if (end == arg || *end || headway < 0)
+		goto fail;
+	set_line_speed(ref, speed, headway);
+	return;
+
+fail:
+	fprintf(stderr, "expected [ref=]speed:headway, not \"%s\"\n", arg);
+	exit(1);
+}
 
-	reset_tags();
-	for (n = nodes; n != nodes+n_nodes; n++) {
-		if (n->station && (allow_proposed || !n->proposed))
-			printf("#STATION %d %d %d # %d\n",
-			    n->x, n->y, n->distance, n->id);
-		if (n->tag)
-			continue;
-		if (!n->n_edges)
-			continue;
-		if (n != nodes)
-			printf("# new net\n\n");
-		recurse(n);
+
+/* ----- Previews --------------------------------------------------------- */
+
+
+static void add_previews(const char *arg)
+{
+	unsigned long cell;
+	char *end;
+
+	while (1) {
+		cell = strtoul(arg, &end, 0);
+		if (end == arg || (*end && *end != ',')) {
+			fprintf(stderr,
+			    "expected cell[,cell ...], not \"%s\"\n", arg);
+			exit(1);
+		}
+		add_preview(cell);
+		if (!*end)
+			break;
+		arg = end+1;
 	}
 }
 
@@ -159,26 +269,326 @@ static void dump_db(void)
 /* ----- Main -------------------------------------------------------------- */
 
 
-int main(int argc, char **argv)
+static void usage(const char *name)
 {
-	if (!strcmp(argv[1], "-p")) {
-		allow_proposed = 1;
-		argv++;
-	}
+	fprintf(stderr,
+"usage: %s [-b file.poly] [-c meters] [-d file] [-i file] [-j threads]\n"
+"       %*s [-k k:file] [-l tolerance:file ...] [-m cutoff:file]\n"
+"       %*s [-n population:file] [-p] [-r cell:file] [-s report]\n"
+"       %*s [-t size:file] [-w profile]\n"
+"       %*s [-D lon,lat ... [-S [ref=]speed:headway ...] -T file]\n"
+"       %*s [-G store] [-M megabytes] [-P cell[,cell ...]]\n"
+"       %*s file.osm|store lon_min lon_max lat_min lat_max\n\n"
+"  -b file.poly\n"
+"              only keep the nodes inside the boundary polygon, in the\n"
+"              .poly format of Osmosis\n"
+"  -c meters   drop road networks that no station reaches, and those with\n"
+"              less than \"meters\" of road (0: only the former)\n"
+"  -d file     write the distance of every node to \"file\", as \"id x y d\"\n"
+"              lines\n"
+"  -i file     write the areas within 333, 666, and 1000 m as polygons\n"
+"  -j threads  route in parallel (0: one thread per CPU)\n"
+"  -k k:file   find the k nearest stations (2 <= k <= %u) and write the\n"
+"              redundancy of coverage and the impact of closing each station\n"
+"              to \"file\"\n"
+"  -l tolerance:file\n"
+"              also write the network simplified to \"tolerance\" meters\n"
+"              (can be repeated for several levels of detail)\n"
+"  -m cutoff:file\n"
+"              write the walking distances between stations up to \"cutoff\"\n"
+"              meters apart to \"file\"\n"
+"  -n population:file\n"
+"              write the population in each distance band, and near each\n"
+"              station, to \"file\". \"population\" has \"lon,lat,people\"\n"
+"              lines, or is a grid of floats in the ESRI .flt format\n"
+"  -p          include proposed stations and lines\n"
+"  -r cell:file\n"
+"              write the detour ratio (walking / straight-line distance) on\n"
+"              a raster of cell x cell meters to \"file\"\n"
+"  -s report   write coverage statistics to the file \"report\"\n"
+"  -t size:file\n"
+"              also write the network in tiles of size x size meters\n"
+"  -w profile  walking profile (default: %s)\n"
+"              available profiles: "
+	    , name, (int) strlen(name), "", (int) strlen(name), "",
+	    (int) strlen(name), "", (int) strlen(name), "",
+	    (int) strlen(name), "", (int) strlen(name), "", MAX_K,
+	    profile->name);
+	list_profiles(stderr);
+	fprintf(stderr, "\n"
+"  -D lon,lat  destination of travel by subway (can be repeated)\n"
+"  -S [ref=]speed:headway\n"
+"              average speed (km/h) and headway (minutes) of the line\n"
+"              \"ref\", or of all other lines (default: 30:5)\n"
+"  -T file     write the average travel time (minutes) and number of\n"
+"              changes to the destinations to \"file\"\n"
+"  -G store    write the graph to a store tiled by longitude and latitude,\n"
+"              which can then be read instead of the OSM file, with any\n"
+"              bounding box inside it, and any of -c, -p, and -w\n"
+"  -M megabytes\n"
+"              sort the map on disk, using at most about this much memory,\n"
+"              and only keep the nodes that are used\n"
+"  -P cell[,cell ...]\n"
+"              route on the graph coarsened to cells of cell x cell meters\n"
+"              first, for each size in turn, and print the coverage of each,\n"
+"              and their errors against the full graph (size 0, added at\n"
+"              the end if not given last)\n");
+	exit(1);
+}
 
-	lon_min = atof(argv[2]);
-	lon_max = atof(argv[3]);
-	lat_min = atof(argv[4]);
-	lat_max = atof(argv[5]);
 
-	fprintf(stderr, "reading %s\n", argv[1]);
-	read_osm_xml(argv[1]);
+int main(int argc, char **argv)
+{
+	const char *report = NULL;
+	const char *poly = NULL;
+	const char *node_table = NULL;
+	const char *tiles = NULL;
+	unsigned tile_size = 0;
+	const char *store = NULL;
+	const char *contours = NULL;
+	const char *closure = NULL;
+	unsigned k = 0;
+	const char *matrix = NULL;
+	unsigned cutoff = 0;
+	const char *travel = NULL;
+	const char *detour = NULL;
+	const char *population = NULL;
+	const char *people = NULL;
+	unsigned cell = 0;
+	FILE *file;
+	char *end;
+	int c;
+
+	/* "+": longitudes and latitudes may be negative */
+	while ((c = getopt(argc, argv,
+	    "+b:c:d:i:j:k:l:m:n:pr:s:t:w:D:G:M:P:S:T:")) != EOF)
+		switch (c) {
+		case 'b':
+			poly = optarg;
+			break;
+		case 'c':
+			min_net_length = strtoul(optarg, &end, 0);
+			if (*end)
+				usage(*argv);
+			prune_nets = 1;
+			break;
+		case 'd':
+			node_table = optarg;
+			break;
+		case 'i':
+			contours = optarg;
+			break;
+		case 'j':
+			set_threads(strtoul(optarg, &end, 0));
+			if (*end)
+				usage(*argv);
+			break;
+		case 'k':
+			k = strtoul(optarg, &end, 0);
+			if (k < 2 || k > MAX_K || *end != ':' || !end[1])
+				usage(*argv);
+			closure = end+1;
+			break;
+		case 'l':
+			add_lod(optarg);
+			break;
+		case 'm':
+			cutoff = strtoul(optarg, &end, 0);
+			if (!cutoff || cutoff > MAX_CUTOFF || *end != ':' ||
+			    !end[1])
+				usage(*argv);
+			matrix = end+1;
+			break;
+		case 'n':
+			end = strchr(optarg, ':');
+			if (!end || end == optarg || !end[1])
+				usage(*argv);
+			population = strndup(optarg, end-optarg);
+			if (!population) {
+				perror("strndup");
+				exit(1);
+			}
+			people = end+1;
+			break;
+		case 'p':
+			allow_proposed = 1;
+			break;
+		case 'r':
+			cell = strtoul(optarg, &end, 0);
+			if (!cell || *end != ':' || !end[1])
+				usage(*argv);
+			detour = end+1;
+			break;
+		case 's':
+			report = optarg;
+			want_stats = 1;
+			break;
+		case 't':
+			tile_size = strtoul(optarg, &end, 0);
+			if (!tile_size || *end != ':' || !end[1])
+				usage(*argv);
+			tiles = end+1;
+			break;
+		case 'w':
+			if (!select_profile(optarg))
+				usage(*argv);
+			break;
+		case 'D':
+			add_dest(optarg);
+			break;
+		case 'G':
+			store = optarg;
+			break;
+		case 'M':
+			mem_budget = strtoul(optarg, &end, 0) << 20;
+			if (!mem_budget || *end)
+				usage(*argv);
+			break;
+		case 'P':
+			add_previews(optarg);
+			break;
+		case 'S':
+			add_speed(optarg);
+			break;
+		case 'T':
+			travel = optarg;
+			break;
+		default:
+			usage(*argv);
+		}
+
+	if (argc-optind != 5)
+		usage(*argv);
+	if (!travel != !have_destinations())
+		usage(*argv);
+
+	lon_min = atof(argv[optind+1]);
+	lon_max = atof(argv[optind+2]);
+	lat_min = atof(argv[optind+3]);
+	lat_max = atof(argv[optind+4]);
+	if (poly)
+		read_poly(poly);
+
+	fprintf(stderr, "reading %s\n", argv[optind]);
+	if (is_store(argv[optind]))
+		read_store(argv[optind]);
+	else
+		read_osm_xml(argv[optind]);
+	if (store)
+		write_store(store);
+	finish_graph();
+	if (have_previews())
+		preview();
 
 	fprintf(stderr, "calculating distances\n");
 	prepare_routing();
+	if (want_stats)
+		register_stations();
 	fprintf(stderr, "routing\n");
 	find_distances();
+	if (have_previews())
+		preview_errors();
 	fprintf(stderr, "writing output\n");
 	dump_db();
+	if (node_table) {
+		file = fopen(node_table, "w");
+		if (!file) {
+			perror(node_table);
+			exit(1);
+		}
+		dump_nodes(file);
+		if (fclose(file) < 0) {
+			perror(node_table);
+			exit(1);
+		}
+	}
+	dump_lods();
+	if (tiles)
+		write_tiles(tiles, tile_size);
+	if (contours) {
+		file = fopen(contours, "w");
+		if (!file) {
+			perror(contours);
+			exit(1);
+		}
+		write_contours(file);
+		if (fclose(file) < 0) {
+			perror(contours);
+			exit(1);
+		}
+	}
+	if (closure) {
+		file = fopen(closure, "w");
+		if (!file) {
+			perror(closure);
+			exit(1);
+		}
+		write_closure(file, k);
+		if (fclose(file) < 0) {
+			perror(closure);
+			exit(1);
+		}
+	}
+	if (matrix) {
+		file = fopen(matrix, "w");
+		if (!file) {
+			perror(matrix);
+			exit(1);
+		}
+		write_matrix(file, cutoff);
+		if (fclose(file) < 0) {
+			perror(matrix);
+			exit(1);
+		}
+	}
+	if (detour) {
+		file = fopen(detour, "w");
+		if (!file) {
+			perror(detour);
+			exit(1);
+		}
+		write_detour(file, cell);
+		if (fclose(file) < 0) {
+			perror(detour);
+			exit(1);
+		}
+	}
+	if (people) {
+		file = fopen(people, "w");
+		if (!file) {
+			perror(people);
+			exit(1);
+		}
+		write_population(file, population);
+		if (fclose(file) < 0) {
+			perror(people);
+			exit(1);
+		}
+	}
+	if (travel) {
+		file = fopen(travel, "w");
+		if (!file) {
+			perror(travel);
+			exit(1);
+		}
+		write_travel(file);
+		if (fclose(file) < 0) {
+			perror(travel);
+			exit(1);
+		}
+	}
+
+	if (report) {
+		file = fopen(report, "w");
+		if (!file) {
+			perror(report);
+			exit(1);
+		}
+		stats_report(file);
+		if (fclose(file) < 0) {
+			perror(report);
+			exit(1);
+		}
+	}
 	return 0;
 }
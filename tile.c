@@ -0,0 +1,362 @@
+/*
+ * tile.c - Spatially tiled output
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+
+#include <zlib.h>
+
+#include "db.h"
+#include "route.h"
+#include "parallel.h"
+#include "tile.h"
+
+
+#define	STATION_REF	UINT32_MAX	/* "edge" of a station reference */
+
+
+static struct tile_header header;
+static struct tile_entry *entries;
+static uint8_t **data;			/* compressed data of each tile */
+
+static struct ref {
+	uint32_t n;
+	uint32_t e;			/* STATION_REF for stations */
+} *refs;
+static uint32_t *first_ref;		/* per tile, plus one at the end */
+
+static int fd;
+static const char *file_name;
+static uint32_t next_tile;
+
+
+/* ----- Assignment to tiles ----------------------------------------------- */
+
+
+static inline int min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+
+static inline int max(int a, int b)
+{
+	return a > b ? a : b;
+}
+
+
+static bool segment(unsigned n, uint32_t e)
+{
+	return node_id[edge_to[e]] > node_id[n];
+}
+
+
+static unsigned col(int x)
+{
+	return (x-header.x0)/(int) header.size;
+}
+
+
+static unsigned row(int y)
+{
+	return (y-header.y0)/(int) header.size;
+}
+
+
+/*
+ * The columns of row "r" that the segment from "n" to "m" goes through. We
+ * take the part of the segment between the lower and the upper edge of the
+ * row, allowing for rounding, so the segment is in every tile it touches,
+ * but not in the other tiles of its bounding box.
+ */
+
+static void seg_cols(unsigned n, unsigned m, unsigned r, unsigned *c0,
+    unsigned *c1)
+{
+	int ax = node_x[n], ay = node_y[n], bx = node_x[m], by = node_y[m];
+	int lo = min(ay, by), hi = max(ay, by);
+	int ya, yb;
+	double xa, xb;
+
+	ya = max(header.y0+(int) (r*header.size), lo);
+	yb = min(header.y0+(int) ((r+1)*header.size), hi);
+	if (ay == by) {
+		xa = ax;
+		xb = bx;
+	} else {
+		xa = ax+(double) (ya-ay)*(bx-ax)/(by-ay);
+		xb = ax+(double) (yb-ay)*(bx-ax)/(by-ay);
+	}
+	*c0 = col(max((int) floor(fmin(xa, xb)-1e-6), min(ax, bx)));
+	*c1 = col(min((int) floor(fmax(xa, xb)+1e-6), max(ax, bx)));
+}
+
+
+static void bounds(void)
+{
+	int xmin, xmax, ymin, ymax;
+
+	graph_bounds(&xmin, &xmax, &ymin, &ymax);
+	header.x0 = xmin;
+	header.y0 = ymin;
+	header.cols = (xmax-xmin)/header.size+1;
+	header.rows = (ymax-ymin)/header.size+1;
+}
+
+
+static void add_ref(bool store, unsigned t, unsigned n, uint32_t e)
+{
+	if (store) {
+		refs[first_ref[t]].n = n;
+		refs[first_ref[t]++].e = e;
+	} else {
+		first_ref[t+1]++;
+	}
+}
+
+
+/*
+ * We go through all the nodes twice: first we count the references of each
+ * tile, then we store them. In between, make_refs turns the counts into the
+ * start of each tile, so that all the references go into one array of just
+ * the right size, in order, without growing a list per tile.
+ */
+
+static void assign(bool store)
+{
+	unsigned n, m, c, r, c0, c1, r0, r1;
+	uint32_t e;
+
+	for (n = 0; n != n_nodes; n++) {
+		if (eligible(n))
+			add_ref(store,
+			    row(node_y[n])*header.cols+col(node_x[n]),
+			    n, STATION_REF);
+		for (e = edge_first[n]; e != edge_first[n+1]; e++) {
+			if (!segment(n, e))
+				continue;
+			m = edge_to[e];
+			r0 = row(min(node_y[n], node_y[m]));
+			r1 = row(max(node_y[n], node_y[m]));
+			for (r = r0; r <= r1; r++) {
+				seg_cols(n, m, r, &c0, &c1);
+				for (c = c0; c <= c1; c++)
+					add_ref(store, r*header.cols+c, n, e);
+			}
+		}
+	}
+}
+
+
+static void make_refs(void)
+{
+	unsigned tiles = header.cols*header.rows;
+	unsigned t;
+
+	first_ref = calloc(tiles+1, sizeof(uint32_t));
+	if (!first_ref) {
+		perror("calloc");
+		exit(1);
+	}
+	assign(0);
+	for (t = 0; t != tiles; t++)
+		first_ref[t+1] += first_ref[t];
+	refs = malloc(sizeof(struct ref)*first_ref[tiles]);
+	if (first_ref[tiles] && !refs) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* "assign" advances first_ref[t] to the end of tile t */
+	assign(1);
+	for (t = tiles; t; t--)
+		first_ref[t] = first_ref[t-1];
+	first_ref[0] = 0;
+}
+
+
+/* ----- Compression ------------------------------------------------------- */
+
+
+struct text {
+	char *buf;
+	size_t len, size;
+};
+
+
+static void print(struct text *text, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void print(struct text *text, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	while (1) {
+		va_start(ap, fmt);
+		len = vsnprintf(text->buf+text->len, text->size-text->len,
+		    fmt, ap);
+		va_end(ap);
+		if (text->len+len < text->size)
+			break;
+		text->size = text->size ? 2*text->size : 65536;
+		text->buf = realloc(text->buf, text->size);
+		if (!text->buf) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	text->len += len;
+}
+
+
+static void format_tile(struct text *text, unsigned t)
+{
+	const struct ref *r;
+	unsigned n, m;
+
+	text->len = 0;
+	for (r = refs+first_ref[t]; r != refs+first_ref[t+1]; r++) {
+		n = r->n;
+		if (r->e == STATION_REF) {
+			print(text, "#STATION %d %d %d # %d\n", node_x[n],
+			    node_y[n], node_distance[n], node_id[n]);
+			continue;
+		}
+		m = edge_to[r->e];
+		print(text, "%d %d %d # %d\n%d %d %d # %d\n\n",
+		    node_x[n], node_y[n], node_distance[n], node_id[n],
+		    node_x[m], node_y[m], node_distance[n], node_id[m]);
+	}
+}
+
+
+static void compress_tiles(void *user, unsigned thread)
+{
+	struct text text = { NULL, 0, 0 };
+	uint32_t t, tiles = header.cols*header.rows;
+	uLongf size;
+
+	while (1) {
+		t = next_job(&next_tile);
+		if (t >= tiles)
+			break;
+		format_tile(&text, t);
+		size = compressBound(text.len);
+		data[t] = malloc(size);
+		if (!data[t]) {
+			perror("malloc");
+			exit(1);
+		}
+		if (compress2(data[t], &size, (const Bytef *) text.buf,
+		    text.len, Z_BEST_COMPRESSION) != Z_OK) {
+			fprintf(stderr, "compress2 failed\n");
+			exit(1);
+		}
+		entries[t].size = size;
+		entries[t].raw = text.len;
+	}
+	free(text.buf);
+}
+
+
+/* ----- Writing ----------------------------------------------------------- */
+
+
+static void write_all(const void *p, size_t len, off_t offset)
+{
+	const uint8_t *buf = p;
+	ssize_t wrote;
+
+	while (len) {
+		wrote = pwrite(fd, buf, len, offset);
+		if (wrote < 0) {
+			perror(file_name);
+			exit(1);
+		}
+		buf += wrote;
+		len -= wrote;
+		offset += wrote;
+	}
+}
+
+
+static void write_data(void *user, unsigned thread)
+{
+	uint32_t t, tiles = header.cols*header.rows;
+
+	while (1) {
+		t = next_job(&next_tile);
+		if (t >= tiles)
+			break;
+		write_all(data[t], entries[t].size, entries[t].offset);
+		free(data[t]);
+	}
+}
+
+
+void write_tiles(const char *name, unsigned size)
+{
+	uint32_t t, tiles;
+	uint64_t offset;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TILE_MAGIC, sizeof(header.magic));
+	header.size = size;
+	bounds();
+	tiles = header.cols*header.rows;
+	make_refs();
+
+	entries = calloc(tiles, sizeof(struct tile_entry));
+	data = calloc(tiles, sizeof(uint8_t *));
+	if (!entries || !data) {
+		perror("calloc");
+		exit(1);
+	}
+
+	next_tile = 0;
+	parallel(compress_tiles, NULL);
+
+	offset = sizeof(header)+sizeof(struct tile_entry)*tiles;
+	for (t = 0; t != tiles; t++) {
+		entries[t].offset = offset;
+		offset += entries[t].size;
+	}
+
+	file_name = name;
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror(name);
+		exit(1);
+	}
+	write_all(&header, sizeof(header), 0);
+	write_all(entries, sizeof(struct tile_entry)*tiles, sizeof(header));
+	next_tile = 0;
+	parallel(write_data, NULL);
+	if (close(fd) < 0) {
+		perror(name);
+		exit(1);
+	}
+
+	fprintf(stderr, "%u tiles, %llu bytes\n", tiles,
+	    (unsigned long long) offset);
+
+	free(entries);
+	free(data);
+	free(refs);
+	free(first_ref);
+}
@@ -0,0 +1,51 @@
+/*
+ * tile.h - Spatially tiled output
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TILE_H
+#define	TILE_H
+
+#include <stdint.h>
+
+
+/*
+ * File layout, all in host byte order:
+ *
+ *   struct tile_header
+ *   struct tile_entry [rows][cols]	row 0 is at the bottom (smallest y)
+ *   tile data, in the same order as the entries
+ *
+ * Each tile is compressed on its own with zlib, and contains the text of a
+ * .gp file: the stations in the tile, and all the segments that go through
+ * it, not merely those whose bounding box touches it. Segments that cross
+ * tile borders appear in each tile they cross, and tilecat prints them once
+ * for each such tile in the viewport. The data of the tiles in a row are
+ * contiguous, so a reader needs only one pread per row of the viewport.
+ */
+
+#define	TILE_MAGIC	"SUBOSMT1"
+
+
+struct tile_header {
+	char magic[8];
+	int32_t x0, y0;		/* lower left corner of tile 0 (m) */
+	uint32_t size;		/* width and height of a tile (m) */
+	uint32_t cols, rows;
+	uint32_t pad;
+};
+
+struct tile_entry {
+	uint64_t offset;	/* from the beginning of the file */
+	uint32_t size;		/* compressed */
+	uint32_t raw;		/* uncompressed */
+};
+
+
+void write_tiles(const char *name, unsigned size);
+
+#endif /* TILE_H */
@@ -0,0 +1,169 @@
+/*
+ * tilecat.c - Extract a viewport from a tiled output file
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <zlib.h>
+
+#include "tile.h"
+
+
+static const char *name;
+static int fd;
+
+
+static void read_all(void *buf, size_t len, off_t offset)
+{
+	ssize_t got;
+
+	while (len) {
+		got = pread(fd, buf, len, offset);
+		if (got < 0) {
+			perror(name);
+			exit(1);
+		}
+		if (!got) {
+			fprintf(stderr, "%s: file is truncated\n", name);
+			exit(1);
+		}
+		buf = (uint8_t *) buf+got;
+		len -= got;
+		offset += got;
+	}
+}
+
+
+/* tile of coordinate "v", rounding down also left of or below the grid */
+
+static int64_t tile(int v, int32_t origin, uint32_t size)
+{
+	int64_t d = (int64_t) v-origin;
+
+	return d >= 0 ? d/size : -((-d+size-1)/size);
+}
+
+
+static int clamp(int64_t v, int max)
+{
+	return v < 0 ? 0 : v > max ? max : v;
+}
+
+
+static void inflate_tile(const uint8_t *buf, const struct tile_entry *e)
+{
+	uLongf len = e->raw;
+	uint8_t *raw;
+
+	raw = malloc(len ? len : 1);
+	if (!raw) {
+		perror("malloc");
+		exit(1);
+	}
+	if (uncompress(raw, &len, buf, e->size) != Z_OK || len != e->raw) {
+		fprintf(stderr, "%s: bad tile data\n", name);
+		exit(1);
+	}
+	fwrite(raw, 1, len, stdout);
+	free(raw);
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s file.tiles [xmin xmax ymin ymax]\n\n"
+"  xmin <= xmax and ymin <= ymax\n", name);
+	exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct tile_header h;
+	struct tile_entry *entries;
+	const struct tile_entry *first, *last;
+	int xmin = INT32_MIN, xmax = INT32_MAX;
+	int ymin = INT32_MIN, ymax = INT32_MAX;
+	int64_t tc0, tc1, tr0, tr1;
+	int c0, c1, r0, r1, r, c;
+	uint8_t *buf;
+	size_t len;
+
+	switch (argc) {
+	case 6:
+		xmin = atoi(argv[2]);
+		xmax = atoi(argv[3]);
+		ymin = atoi(argv[4]);
+		ymax = atoi(argv[5]);
+		if (xmin > xmax || ymin > ymax)
+			usage(*argv);
+		/* fall through */
+	case 2:
+		name = argv[1];
+		break;
+	default:
+		usage(*argv);
+	}
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		perror(name);
+		exit(1);
+	}
+	read_all(&h, sizeof(h), 0);
+	if (memcmp(h.magic, TILE_MAGIC, sizeof(h.magic))) {
+		fprintf(stderr, "%s: not a tile file\n", name);
+		exit(1);
+	}
+
+	/* a viewport that misses the grid gets nothing, not the edge tiles */
+	tc0 = tile(xmin, h.x0, h.size);
+	tc1 = tile(xmax, h.x0, h.size);
+	tr0 = tile(ymin, h.y0, h.size);
+	tr1 = tile(ymax, h.y0, h.size);
+	if (tc1 < 0 || tc0 >= h.cols || tr1 < 0 || tr0 >= h.rows)
+		return 0;
+	c0 = clamp(tc0, h.cols-1);
+	c1 = clamp(tc1, h.cols-1);
+	r0 = clamp(tr0, h.rows-1);
+	r1 = clamp(tr1, h.rows-1);
+
+	/* the index entries of all rows in the viewport, in one go */
+	len = sizeof(struct tile_entry)*h.cols*(r1-r0+1);
+	entries = malloc(len);
+	if (!entries) {
+		perror("malloc");
+		exit(1);
+	}
+	read_all(entries, len,
+	    sizeof(h)+sizeof(struct tile_entry)*h.cols*r0);
+
+	/* then the data of each row */
+	for (r = r0; r <= r1; r++) {
+		first = entries+(r-r0)*h.cols+c0;
+		last = entries+(r-r0)*h.cols+c1;
+		len = last->offset+last->size-first->offset;
+		buf = malloc(len ? len : 1);
+		if (!buf) {
+			perror("malloc");
+			exit(1);
+		}
+		read_all(buf, len, first->offset);
+		for (c = c0; c <= c1; c++)
+			inflate_tile(buf+first[c-c0].offset-first->offset,
+			    first+c-c0);
+		free(buf);
+	}
+	return 0;
+}
@@ -0,0 +1,473 @@
+/*
+ * travel.c - Travel times by subway and on foot
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * The graph has two kinds of states: being on foot at a node, and being on a
+ * train of a given line at a given stop, a "platform". Walking to a stop and
+ * boarding costs the walk plus half the headway of the line, riding costs the
+ * distance between stops at the speed of the line, and alighting costs the
+ * walk away from the stop.
+ *
+ * Labels are (time, boardings), compared lexically, so among equally fast
+ * ways we prefer the one with fewer changes. We search backwards from each
+ * destination, which gives the time from all origins to it in one go, and
+ * search from the destinations in parallel.
+ */
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "util.h"
+#include "heap.h"
+#include "db.h"
+#include "route.h"
+#include "parallel.h"
+#include "travel.h"
+
+
+#define	WALK_SPEED	1.3		/* m/s */
+#define	TICKS		10		/* time unit is 1/TICKS s */
+#define	MAX_TIME	(2*3600*TICKS)	/* don't search beyond 2 hours */
+#define	MAX_BOARDINGS	255
+
+#define	UNSEEN		UINT64_MAX	/* label */
+#define	LAST_STOP	UINT32_MAX	/* ride */
+
+
+static struct speed {
+	const char *ref;	/* NULL for the default */
+	double speed;		/* m/s */
+	double headway;		/* s */
+	struct speed *next;
+} default_speed = {
+	.speed		= 30/3.6,
+	.headway	= 5*60,
+}, *speeds = NULL;
+
+static struct dest {
+	double lon, lat;
+	int x, y;	/* projected when we're done parsing */
+} *dests;
+static uint32_t n_dests, dests_size;
+
+static uint32_t n_platforms;	/* platform p is stop line_stops[p] */
+static uint32_t *platform_wait;	/* boarding, in ticks */
+static uint32_t *platform_ride;	/* to the next stop, or LAST_STOP */
+
+/* walk between platform and nodes: nodes of each platform and vice versa */
+
+static uint32_t *p_first, *p_node, *p_time;
+static uint32_t *n_first, *n_platform, *n_time;
+
+static uint32_t next_job_nr;	/* platform or destination */
+
+
+/* ----- Configuration ----------------------------------------------------- */
+
+
+void set_line_speed(const char *ref, double speed, double headway)
+{
+	struct speed *s;
+
+	if (ref) {
+		s = malloc(sizeof(struct speed));
+		if (!s) {
+			perror("malloc");
+			exit(1);
+		}
+		s->ref = ref;
+		s->next = speeds;
+		speeds = s;
+	} else {
+		s = &default_speed;
+	}
+	s->speed = speed/3.6;
+	s->headway = headway*60;
+}
+
+
+void add_destination(double lon, double lat)
+{
+	if (n_dests == dests_size) {
+		dests_size = dests_size ? 2*dests_size : 16;
+		dests = realloc(dests, sizeof(struct dest)*dests_size);
+		if (!dests) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	dests[n_dests].lon = lon;
+	dests[n_dests].lat = lat;
+	n_dests++;
+}
+
+
+bool have_destinations(void)
+{
+	return n_dests;
+}
+
+
+static const struct speed *line_speed(const struct line *l)
+{
+	const struct speed *s;
+
+	if (l->ref)
+		for (s = speeds; s; s = s->next)
+			if (!strcmp(s->ref, l->ref))
+				return s;
+	return &default_speed;
+}
+
+
+/* ----- Platforms --------------------------------------------------------- */
+
+
+static uint32_t walk_time(double d)
+{
+	return d/WALK_SPEED*TICKS;
+}
+
+
+static void make_platforms(void)
+{
+	const struct line *l;
+	const struct speed *s;
+	uint32_t p, a, b;
+
+	n_platforms = n_lines ? lines[n_lines-1].first+lines[n_lines-1].n : 0;
+	platform_wait = alloc_array(n_platforms, sizeof(uint32_t));
+	platform_ride = alloc_array(n_platforms, sizeof(uint32_t));
+	for (l = lines; l != lines+n_lines; l++) {
+		s = line_speed(l);
+		for (p = l->first; p != l->first+l->n; p++) {
+			platform_wait[p] = s->headway/2*TICKS;
+			if (p == l->first+l->n-1) {
+				platform_ride[p] = LAST_STOP;
+				continue;
+			}
+			a = line_stops[p];
+			b = line_stops[p+1];
+			platform_ride[p] = hypot(node_x[a]-node_x[b],
+			    node_y[a]-node_y[b])/s->speed*TICKS;
+		}
+	}
+}
+
+
+/*
+ * Counts the nodes near each platform, then stores them, in two passes like
+ * assign in tile.c. Platforms are independent of each other, so we can do
+ * both in parallel.
+ */
+
+static void find_access(void *user, unsigned thread)
+{
+	bool store = user;
+	uint32_t p, n, stop, k;
+	double d;
+
+	while (1) {
+		p = next_job(&next_job_nr);
+		if (p >= n_platforms)
+			break;
+		stop = line_stops[p];
+		for (n = 0; n != n_nodes; n++) {
+			if (edge_first[n] == edge_first[n+1])
+				continue;
+			d = hypot(node_x[stop]-node_x[n],
+			    node_y[stop]-node_y[n]);
+			if (d > NEAR)
+				continue;
+			if (store) {
+				k = p_first[p]++;
+				p_node[k] = n;
+				p_time[k] = walk_time(d);
+			} else {
+				p_first[p+1]++;
+			}
+		}
+	}
+}
+
+
+static void make_access(void)
+{
+	uint32_t *next;
+	uint32_t p, n, k, i;
+
+	p_first = calloc(n_platforms+1, sizeof(uint32_t));
+	if (!p_first) {
+		perror("calloc");
+		exit(1);
+	}
+	next_job_nr = 0;
+	parallel(find_access, NULL);
+	for (p = 0; p != n_platforms; p++)
+		p_first[p+1] += p_first[p];
+	p_node = alloc_array(p_first[n_platforms], sizeof(uint32_t));
+	p_time = alloc_array(p_first[n_platforms], sizeof(uint32_t));
+
+	/* "find_access" advances p_first[p] to the end of platform p */
+	next_job_nr = 0;
+	parallel(find_access, (void *) 1);
+	for (p = n_platforms; p; p--)
+		p_first[p] = p_first[p-1];
+	p_first[0] = 0;
+
+	/* the same, indexed by node */
+	n_first = calloc(n_nodes+1, sizeof(uint32_t));
+	if (!n_first) {
+		perror("calloc");
+		exit(1);
+	}
+	for (k = 0; k != p_first[n_platforms]; k++)
+		n_first[p_node[k]+1]++;
+	for (n = 0; n != n_nodes; n++)
+		n_first[n+1] += n_first[n];
+	n_platform = alloc_array(p_first[n_platforms], sizeof(uint32_t));
+	n_time = alloc_array(p_first[n_platforms], sizeof(uint32_t));
+	next = alloc_array(n_nodes, sizeof(uint32_t));
+	memcpy(next, n_first, sizeof(uint32_t)*n_nodes);
+	for (p = 0; p != n_platforms; p++)
+		for (k = p_first[p]; k != p_first[p+1]; k++) {
+			i = next[p_node[k]]++;
+			n_platform[i] = p;
+			n_time[i] = p_time[k];
+		}
+	free(next);
+}
+
+
+/* ----- Search ------------------------------------------------------------ */
+
+
+/*
+ * States 0 ... n_nodes-1 are on foot, n_nodes+p is on platform p. A label
+ * is the time shifted left by 8 bits, plus the number of boardings.
+ */
+
+struct worker {
+	uint64_t *label;	/* per state */
+	struct heap heap;	/* key: label, val: state */
+
+	/* per node, summed over the destinations */
+	uint32_t *sum_time;	/* seconds */
+	uint32_t *sum_changes;
+	uint32_t *reached;
+};
+
+
+static inline uint64_t make_label(uint64_t time, unsigned boardings)
+{
+	return time << 8 | boardings;
+}
+
+
+static void reach(struct worker *w, uint32_t s, uint64_t time,
+    unsigned boardings)
+{
+	uint64_t label;
+
+	if (time > MAX_TIME)
+		return;
+	if (boardings > MAX_BOARDINGS)
+		boardings = MAX_BOARDINGS;
+	label = make_label(time, boardings);
+	if (label >= w->label[s])
+		return;
+	w->label[s] = label;
+	heap_push(&w->heap, label, s);
+}
+
+
+/*
+ * We search backwards, so from each state we go to the states that lead to
+ * it.
+ */
+
+static void expand(struct worker *w, uint32_t s, uint64_t label)
+{
+	uint64_t time = label >> 8;
+	unsigned boardings = label & 0xff;
+	uint32_t e, k, p;
+
+	if (s < n_nodes) {
+		for (e = edge_first[s]; e != edge_first[s+1]; e++)
+			reach(w, edge_to[e],
+			    time+walk_time(edge_len[e]), boardings);
+		/* alight at a platform and walk here */
+		for (k = n_first[s]; k != n_first[s+1]; k++)
+			reach(w, n_nodes+n_platform[k], time+n_time[k],
+			    boardings);
+		return;
+	}
+
+	p = s-n_nodes;
+	/* ride from the previous stop of the line */
+	if (p && platform_ride[p-1] != LAST_STOP)
+		reach(w, s-1, time+platform_ride[p-1], boardings);
+	/* walk here from a node and board */
+	for (k = p_first[p]; k != p_first[p+1]; k++)
+		reach(w, p_node[k], time+p_time[k]+platform_wait[p],
+		    boardings+1);
+}
+
+
+/*
+ * Like stations, destinations capture all the nodes within NEAR. If there are
+ * none, we start from the closest node.
+ */
+
+static void search(struct worker *w, const struct dest *d)
+{
+	uint32_t n, closest = 0, states = n_nodes+n_platforms;
+	struct heap_entry top;
+	unsigned boardings;
+	double dist, best = -1;
+
+	for (n = 0; n != states; n++)
+		w->label[n] = UNSEEN;
+	for (n = 0; n != n_nodes; n++) {
+		if (edge_first[n] == edge_first[n+1])
+			continue;
+		dist = hypot(d->x-node_x[n], d->y-node_y[n]);
+		if (dist <= NEAR)
+			reach(w, n, walk_time(dist), 0);
+		if (best < 0 || dist < best) {
+			best = dist;
+			closest = n;
+		}
+	}
+	if (best > NEAR)
+		reach(w, closest, walk_time(best), 0);
+
+	while (w->heap.n) {
+		top = heap_pop(&w->heap);
+		if (top.key != w->label[top.val])
+			continue;	/* stale entry */
+		expand(w, top.val, top.key);
+	}
+
+	for (n = 0; n != n_nodes; n++) {
+		if (w->label[n] == UNSEEN)
+			continue;
+		boardings = w->label[n] & 0xff;
+		w->sum_time[n] += (w->label[n] >> 8)/TICKS;
+		w->sum_changes[n] += boardings ? boardings-1 : 0;
+		w->reached[n]++;
+	}
+}
+
+
+static void travel(void *user, unsigned thread)
+{
+	struct worker *w = (struct worker *) user+thread;
+	uint32_t i;
+
+	w->label = alloc_array(n_nodes+n_platforms, sizeof(uint64_t));
+	w->sum_time = calloc(n_nodes, sizeof(uint32_t));
+	w->sum_changes = calloc(n_nodes, sizeof(uint32_t));
+	w->reached = calloc(n_nodes, sizeof(uint32_t));
+	if (n_nodes && (!w->sum_time || !w->sum_changes || !w->reached)) {
+		perror("calloc");
+		exit(1);
+	}
+	heap_init(&w->heap);
+
+	while (1) {
+		i = next_job(&next_job_nr);
+		if (i >= n_dests)
+			break;
+		search(w, dests+i);
+	}
+	free(w->label);
+	heap_free(&w->heap);
+}
+
+
+/* ----- Output ------------------------------------------------------------ */
+
+
+/*
+ * Only nodes that can reach all the destinations get a travel time, so that
+ * the averages are comparable.
+ */
+
+void write_travel(FILE *file)
+{
+	struct worker *workers, *w;
+	uint32_t n, m, e, i;
+	unsigned t;
+
+	for (i = 0; i != n_dests; i++)
+		map_point(dests[i].lat, dests[i].lon,
+		    &dests[i].x, &dests[i].y);
+	make_platforms();
+	make_access();
+
+	workers = calloc(threads, sizeof(struct worker));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+	next_job_nr = 0;
+	parallel(travel, workers);
+
+	for (w = workers+1; w != workers+threads; w++) {
+		for (n = 0; n != n_nodes; n++) {
+			workers->sum_time[n] += w->sum_time[n];
+			workers->sum_changes[n] += w->sum_changes[n];
+			workers->reached[n] += w->reached[n];
+		}
+		free(w->sum_time);
+		free(w->sum_changes);
+		free(w->reached);
+	}
+
+	w = workers;
+	for (n = 0; n != n_nodes; n++) {
+		if (w->reached[n] != n_dests)
+			continue;
+		for (e = edge_first[n]; e != edge_first[n+1]; e++) {
+			m = edge_to[e];
+			if (node_id[m] <= node_id[n] ||
+			    w->reached[m] != n_dests)
+				continue;
+			for (t = 0; t != 2; t++)
+				fprintf(file, "%d %d %.1f %.2f # %d\n",
+				    node_x[t ? m : n], node_y[t ? m : n],
+				    w->sum_time[n]/60.0/n_dests,
+				    (double) w->sum_changes[n]/n_dests,
+				    node_id[t ? m : n]);
+			fprintf(file, "\n");
+		}
+	}
+
+	fprintf(stderr, "%u lines, %u platforms, %u destinations\n",
+	    n_lines, n_platforms, n_dests);
+
+	free(w->sum_time);
+	free(w->sum_changes);
+	free(w->reached);
+	free(workers);
+	free(platform_wait);
+	free(platform_ride);
+	free(p_first);
+	free(p_node);
+	free(p_time);
+	free(n_first);
+	free(n_platform);
+	free(n_time);
+}
@@ -0,0 +1,35 @@
+/*
+ * travel.h - Travel times by subway and on foot
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef TRAVEL_H
+#define	TRAVEL_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+
+/*
+ * Set the average speed (km/h, including stops) and the headway (minutes) of
+ * the line with the given "ref" tag, or of all other lines if "ref" is NULL.
+ */
+
+void set_line_speed(const char *ref, double speed, double headway);
+
+void add_destination(double lon, double lat);
+
+bool have_destinations(void);
+
+/*
+ * For each node, write the average travel time (minutes) to the destinations,
+ * and the average number of train changes, in the format of dump_db.
+ */
+
+void write_travel(FILE *file);
+
+#endif /* TRAVEL_H */
@@ -0,0 +1,39 @@
+/*
+ * util.c - Common helpers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "util.h"
+
+
+void *alloc_array(size_t n, size_t size)
+{
+	void *p;
+
+	p = malloc(n*size);
+	if (n && !p) {
+		perror("malloc");
+		exit(1);
+	}
+	return p;
+}
+
+
+void *zalloc_array(size_t n, size_t size)
+{
+	void *p;
+
+	p = calloc(n, size);
+	if (n && !p) {
+		perror("calloc");
+		exit(1);
+	}
+	return p;
+}
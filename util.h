@@ -0,0 +1,21 @@
+/*
+ * util.h - Common helpers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef UTIL_H
+#define	UTIL_H
+
+#include <stddef.h>
+
+
+/* allocate n elements, or exit if we can't; zalloc_array also clears them */
+
+void *alloc_array(size_t n, size_t size);
+void *zalloc_array(size_t n, size_t size);
+
+#endif /* UTIL_H */